@@ -17,6 +17,11 @@
 #include "ClearKeyAsyncShutdown.h"
 #include "gmp-task-utils.h"
 
+#include <assert.h>
+
+/* static */ ClearKeyAsyncShutdown* ClearKeyAsyncShutdown::sShuttingDown = nullptr;
+/* static */ uint32_t ClearKeyAsyncShutdown::sNumShutdownBlockers = 0;
+
 ClearKeyAsyncShutdown::ClearKeyAsyncShutdown(GMPAsyncShutdownHost *aHostAPI)
   : mHost(aHostAPI)
 {
@@ -29,17 +34,54 @@ ClearKeyAsyncShutdown::~ClearKeyAsyncShutdown()
   CK_LOGD("ClearKeyAsyncShutdown::~ClearKeyAsyncShutdown");
 }
 
-void ShutdownTask(ClearKeyAsyncShutdown* aSelf, GMPAsyncShutdownHost* aHost)
+/* static */ void
+ClearKeyAsyncShutdown::BlockShutdown()
+{
+  sNumShutdownBlockers++;
+}
+
+/* static */ void
+ClearKeyAsyncShutdown::UnblockShutdown()
 {
-  // Dumb implementation that just immediately reports completion.
-  // Real GMPs should ensure they are properly shutdown.
-  CK_LOGD("ClearKeyAsyncShutdown::BeginShutdown calling ShutdownComplete");
-  aHost->ShutdownComplete();
-  aSelf->Release();
+  assert(sNumShutdownBlockers > 0);
+  if (!--sNumShutdownBlockers && sShuttingDown) {
+    CK_LOGD("ClearKeyAsyncShutdown outstanding work finished");
+    sShuttingDown->Complete();
+  }
+}
+
+void
+ClearKeyAsyncShutdown::Complete()
+{
+  if (!mHost) {
+    // Already reported, either when the work finished or on timeout.
+    return;
+  }
+  CK_LOGD("ClearKeyAsyncShutdown calling ShutdownComplete");
+  sShuttingDown = nullptr;
+  GMPAsyncShutdownHost* host = mHost;
+  mHost = nullptr;
+  host->ShutdownComplete();
+  // Drop the reference we added in the constructor. Pending tasks hold
+  // their own references.
+  Release();
 }
 
 void ClearKeyAsyncShutdown::BeginShutdown()
 {
-  CK_LOGD("ClearKeyAsyncShutdown::BeginShutdown dispatching asynchronous shutdown task");
-  GetPlatform()->runonmainthread(WrapTaskNM(ShutdownTask, this, mHost));
+  CK_LOGD("ClearKeyAsyncShutdown::BeginShutdown %u blockers", sNumShutdownBlockers);
+  assert(!sShuttingDown);
+
+  GMPTask* complete = WrapTaskRefCounted(this, &ClearKeyAsyncShutdown::Complete);
+  if (!sNumShutdownBlockers) {
+    GetPlatform()->runonmainthread(complete);
+    return;
+  }
+
+  // Wait for outstanding work to finish, but don't hold up the host
+  // indefinitely if it doesn't.
+  sShuttingDown = this;
+  if (GMP_FAILED(GetPlatform()->settimer(complete, CLEARKEY_SHUTDOWN_TIMEOUT_MS))) {
+    complete->Destroy();
+  }
 }
@@ -20,6 +20,12 @@
 #include "gmp-api/gmp-async-shutdown.h"
 #include "RefCounted.h"
 
+// How long BeginShutdown() waits for outstanding work before reporting
+// ShutdownComplete() anyway.
+#ifndef CLEARKEY_SHUTDOWN_TIMEOUT_MS
+#define CLEARKEY_SHUTDOWN_TIMEOUT_MS 3000
+#endif
+
 class ClearKeyAsyncShutdown : public GMPAsyncShutdown
                             , public RefCounted
 {
@@ -28,10 +34,22 @@ public:
 
   void BeginShutdown() override;
 
+  // Work which must finish before we report ShutdownComplete(), such as
+  // tearing down decrypt threads and writing to storage, calls
+  // BlockShutdown() when it starts and UnblockShutdown() when it's done.
+  // Main thread only.
+  static void BlockShutdown();
+  static void UnblockShutdown();
+
 private:
   virtual ~ClearKeyAsyncShutdown();
 
+  void Complete();
+
   GMPAsyncShutdownHost* mHost;
+
+  static ClearKeyAsyncShutdown* sShuttingDown;
+  static uint32_t sNumShutdownBlockers;
 };
 
 #endif // __ClearKeyAsyncShutdown_h__
@@ -16,77 +16,102 @@
 
 #include "ClearKeyBase64.h"
 
-#include <algorithm>
+// Number of base64 characters encoding a 16 byte CENC key or keyId.
+static const size_t kEncodedKeyLength = 22;
 
-using namespace std;
+// Maps each character to its 6-bit value. Both the base64url ('-', '_') and
+// standard ('+', '/') alphabets are accepted. Characters which aren't base64
+// map to 0xff, which has its high bit set unlike every valid value.
+static const uint8_t kDecodeTable[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
 
-/**
-* Take a base64-encoded string, convert (in-place) each character to its
-* corresponding value in the [0x00, 0x3f] range, and truncate any padding.
-*/
-static bool
-Decode6Bit(string& aStr)
+static const char kEncodeAlphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+bool
+DecodeBase64KeyOrId(const uint8_t* aEncoded, size_t aEncodedLength,
+                    uint8_t* aOutDecoded)
 {
-  for (size_t i = 0; i < aStr.length(); i++) {
-    if (aStr[i] >= 'A' && aStr[i] <= 'Z') {
-      aStr[i] -= 'A';
-    }
-    else if (aStr[i] >= 'a' && aStr[i] <= 'z') {
-      aStr[i] -= 'a' - 26;
-    }
-    else if (aStr[i] >= '0' && aStr[i] <= '9') {
-      aStr[i] -= '0' - 52;
-    }
-    else if (aStr[i] == '-' || aStr[i] == '+') {
-      aStr[i] = 62;
-    }
-    else if (aStr[i] == '_' || aStr[i] == '/') {
-      aStr[i] = 63;
-    }
-    else {
-      // Truncate '=' padding at the end of the aString.
-      if (aStr[i] != '=') {
-        aStr.erase(i, string::npos);
-        return false;
-      }
-      aStr[i] = '\0';
-      aStr.resize(i);
-      break;
-    }
+  // Expect exactly 22 characters, optionally followed by "==" padding.
+  if (aEncodedLength != kEncodedKeyLength &&
+      (aEncodedLength != kEncodedKeyLength + 2 ||
+       aEncoded[kEncodedKeyLength] != '=' ||
+       aEncoded[kEncodedKeyLength + 1] != '=')) {
+    return false;
+  }
+
+  // Decode without branching on the input; we check whether any character
+  // was invalid once at the end.
+  uint8_t invalid = 0;
+  const uint8_t* in = aEncoded;
+  uint8_t* out = aOutDecoded;
+  for (size_t i = 0; i < 5; i++) {
+    uint8_t a = kDecodeTable[in[0]];
+    uint8_t b = kDecodeTable[in[1]];
+    uint8_t c = kDecodeTable[in[2]];
+    uint8_t d = kDecodeTable[in[3]];
+    invalid |= a | b | c | d;
+    uint32_t triple = uint32_t(a) << 18 | uint32_t(b) << 12 |
+                      uint32_t(c) << 6 | uint32_t(d);
+    out[0] = uint8_t(triple >> 16);
+    out[1] = uint8_t(triple >> 8);
+    out[2] = uint8_t(triple);
+    in += 4;
+    out += 3;
   }
+  // The last two characters encode the 16th byte; the 4 bits left over are
+  // padding and are ignored.
+  uint8_t a = kDecodeTable[in[0]];
+  uint8_t b = kDecodeTable[in[1]];
+  invalid |= a | b;
+  out[0] = uint8_t(a << 2 | b >> 4);
 
-  return true;
+  return !(invalid & 0x80);
 }
 
-bool
-DecodeBase64KeyOrId(const string& aEncoded, vector<uint8_t>& aOutDecoded)
+void
+EncodeBase64Web(const uint8_t* aBinary, size_t aLength, char* aOutEncoded)
 {
-  string encoded = aEncoded;
-  if (!Decode6Bit(encoded) ||
-    encoded.size() != 22) { // Can't decode to 16 byte CENC key or keyId.
-    return false;
+  char* out = aOutEncoded;
+  size_t i = 0;
+  for (; i + 3 <= aLength; i += 3) {
+    uint32_t triple = uint32_t(aBinary[i]) << 16 |
+                      uint32_t(aBinary[i + 1]) << 8 |
+                      uint32_t(aBinary[i + 2]);
+    out[0] = kEncodeAlphabet[triple >> 18];
+    out[1] = kEncodeAlphabet[(triple >> 12) & 0x3f];
+    out[2] = kEncodeAlphabet[(triple >> 6) & 0x3f];
+    out[3] = kEncodeAlphabet[triple & 0x3f];
+    out += 4;
   }
 
-  // The number of bytes we haven't yet filled in the current byte, mod 8.
-  int shift = 0;
-
-  aOutDecoded.resize(16);
-  vector<uint8_t>::iterator out = aOutDecoded.begin();
-  for (size_t i = 0; i < encoded.length(); i++) {
-    if (!shift) {
-      *out = encoded[i] << 2;
+  // Encode any remaining 1 or 2 bytes as 2 or 3 characters, without padding.
+  size_t remaining = aLength - i;
+  if (remaining) {
+    uint32_t triple = uint32_t(aBinary[i]) << 16;
+    if (remaining == 2) {
+      triple |= uint32_t(aBinary[i + 1]) << 8;
     }
-    else {
-      *out |= encoded[i] >> (6 - shift);
-      out++;
-      if (out == aOutDecoded.end()) {
-        // Hit last 6bit octed in encoded, which is padding and can be ignored.
-        break;
-      }
-      *out = encoded[i] << (shift + 2);
+    out[0] = kEncodeAlphabet[triple >> 18];
+    out[1] = kEncodeAlphabet[(triple >> 12) & 0x3f];
+    if (remaining == 2) {
+      out[2] = kEncodeAlphabet[(triple >> 6) & 0x3f];
     }
-    shift = (shift + 2) % 8;
   }
-
-  return true;
-}
\ No newline at end of file
+}
@@ -17,15 +17,29 @@
 #ifndef __ClearKeyBase64_h__
 #define __ClearKeyBase64_h__
 
-#include <vector>
-#include <string>
+#include <stddef.h>
 #include <stdint.h>
 
 // Decodes a base64 encoded CENC Key or KeyId into it's raw bytes. Note that
-// CENC Keys or KeyIds are 16 bytes long, so encoded they should be 22 bytes
-// plus any padding. Fails (returns false) on input that is more than 22 bytes
-// long after padding is stripped. Returns true on success.
+// CENC Keys or KeyIds are 16 bytes long, so encoded they must be exactly 22
+// characters, optionally followed by "==" padding. Either the base64url or
+// the standard alphabet may be used. Returns true on success, in which case
+// the 16 decoded bytes have been written to aOutDecoded.
 bool
-DecodeBase64KeyOrId(const std::string& aEncoded, std::vector<uint8_t>& aOutDecoded);
+DecodeBase64KeyOrId(const uint8_t* aEncoded, size_t aEncodedLength,
+                    uint8_t* aOutDecoded);
+
+// Number of characters EncodeBase64Web() writes for aLength bytes.
+inline size_t
+Base64WebEncodedLength(size_t aLength)
+{
+  return (aLength * 8 + 5) / 6;
+}
+
+// ClearKey expects all Key IDs to be base64 encoded with the base64url
+// alphabet and no padding. Writes Base64WebEncodedLength(aLength) characters
+// to aOutEncoded; it is not null terminated.
+void
+EncodeBase64Web(const uint8_t* aBinary, size_t aLength, char* aOutEncoded);
 
 #endif
@@ -34,6 +34,10 @@ public:
 
   const Key& DecryptionKey() const { return mKey; }
 
+  // Number of sessions expecting this key. Guarded by the
+  // ClearKeyDecryptionManager's mutex.
+  uint32_t mNumSessions;
+
 private:
   ~ClearKeyDecryptor();
 
@@ -53,6 +57,7 @@ ClearKeyDecryptionManager::Get()
 }
 
 ClearKeyDecryptionManager::ClearKeyDecryptionManager()
+  : mMutex(GMPCreateMutex())
 {
   CK_LOGD("ClearKeyDecryptionManager::ClearKeyDecryptionManager");
 }
@@ -67,11 +72,16 @@ ClearKeyDecryptionManager::~ClearKeyDecryptionManager()
     it->second->Release();
   }
   mDecryptors.clear();
+
+  if (mMutex) {
+    mMutex->Destroy();
+  }
 }
 
 bool
 ClearKeyDecryptionManager::HasSeenKeyId(const KeyId& aKeyId) const
 {
+  AutoLock lock(mMutex);
   CK_LOGD("ClearKeyDecryptionManager::SeenKeyId %s", mDecryptors.find(aKeyId) != mDecryptors.end() ? "t" : "f");
   return mDecryptors.find(aKeyId) != mDecryptors.end();
 }
@@ -79,6 +89,7 @@ ClearKeyDecryptionManager::HasSeenKeyId(const KeyId& aKeyId) const
 bool
 ClearKeyDecryptionManager::IsExpectingKeyForKeyId(const KeyId& aKeyId) const
 {
+  // Note: Caller must hold mMutex.
   CK_LOGD("ClearKeyDecryptionManager::IsExpectingKeyForId %08x...", *(uint32_t*)&aKeyId[0]);
   const auto& decryptor = mDecryptors.find(aKeyId);
   return decryptor != mDecryptors.end() && !decryptor->second->HasKey();
@@ -87,6 +98,7 @@ ClearKeyDecryptionManager::IsExpectingKeyForKeyId(const KeyId& aKeyId) const
 bool
 ClearKeyDecryptionManager::HasKeyForKeyId(const KeyId& aKeyId) const
 {
+  AutoLock lock(mMutex);
   CK_LOGD("ClearKeyDecryptionManager::HasKeyForKeyId");
   const auto& decryptor = mDecryptors.find(aKeyId);
   return decryptor != mDecryptors.end() && decryptor->second->HasKey();
@@ -96,15 +108,42 @@ const Key&
 ClearKeyDecryptionManager::GetDecryptionKey(const KeyId& aKeyId)
 {
   assert(HasKeyForKeyId(aKeyId));
+  AutoLock lock(mMutex);
+  // Keys never change once set, so the reference stays valid for as long as
+  // the key ID is expected.
   return mDecryptors[aKeyId]->DecryptionKey();
 }
 
-void
+bool
 ClearKeyDecryptionManager::InitKey(KeyId aKeyId, Key aKey)
 {
   CK_LOGD("ClearKeyDecryptionManager::InitKey %08x...", *(uint32_t*)&aKeyId[0]);
-  if (IsExpectingKeyForKeyId(aKeyId)) {
-    mDecryptors[aKeyId]->InitKey(aKey);
+  AutoLock lock(mMutex);
+  if (!IsExpectingKeyForKeyId(aKeyId)) {
+    return false;
+  }
+  mDecryptors[aKeyId]->InitKey(aKey);
+  return true;
+}
+
+void
+ClearKeyDecryptionManager::RemoveKeys(const std::vector<KeyId>& aKeyIds)
+{
+  CK_LOGD("ClearKeyDecryptionManager::RemoveKeys %u",
+          (uint32_t)aKeyIds.size());
+  AutoLock lock(mMutex);
+  for (size_t i = 0; i < aKeyIds.size(); i++) {
+    auto it = mDecryptors.find(aKeyIds[i]);
+    if (it == mDecryptors.end() || !it->second->HasKey()) {
+      continue;
+    }
+    // Keys never change once set, so swap in a decryptor without one. The
+    // old one lives on while it's decrypting a sample.
+    ClearKeyDecryptor* decryptor = new ClearKeyDecryptor();
+    decryptor->AddRef();
+    decryptor->mNumSessions = it->second->mNumSessions;
+    it->second->Release();
+    it->second = decryptor;
   }
 }
 
@@ -112,21 +151,46 @@ void
 ClearKeyDecryptionManager::ExpectKeyId(KeyId aKeyId)
 {
   CK_LOGD("ClearKeyDecryptionManager::ExpectKeyId %08x...", *(uint32_t*)&aKeyId[0]);
-  if (!HasSeenKeyId(aKeyId)) {
-    mDecryptors[aKeyId] = new ClearKeyDecryptor();
+  AutoLock lock(mMutex);
+  ClearKeyDecryptor*& decryptor = mDecryptors[aKeyId];
+  if (!decryptor) {
+    decryptor = new ClearKeyDecryptor();
+    decryptor->AddRef();
   }
-  mDecryptors[aKeyId]->AddRef();
+  decryptor->mNumSessions++;
 }
 
 void
 ClearKeyDecryptionManager::ReleaseKeyId(KeyId aKeyId)
 {
   CK_LOGD("ClearKeyDecryptionManager::ReleaseKeyId");
-  assert(HasSeenKeyId(aKeyId));
+  AutoLock lock(mMutex);
+  ReleaseKeyIdLocked(aKeyId);
+}
+
+void
+ClearKeyDecryptionManager::ReleaseKeyIds(const std::vector<KeyId>& aKeyIds)
+{
+  CK_LOGD("ClearKeyDecryptionManager::ReleaseKeyIds %u",
+          (uint32_t)aKeyIds.size());
+  AutoLock lock(mMutex);
+  for (size_t i = 0; i < aKeyIds.size(); i++) {
+    ReleaseKeyIdLocked(aKeyIds[i]);
+  }
+}
 
-  ClearKeyDecryptor* decryptor = mDecryptors[aKeyId];
-  if (!decryptor->Release()) {
-    mDecryptors.erase(aKeyId);
+void
+ClearKeyDecryptionManager::ReleaseKeyIdLocked(const KeyId& aKeyId)
+{
+  auto it = mDecryptors.find(aKeyId);
+  assert(it != mDecryptors.end());
+
+  ClearKeyDecryptor* decryptor = it->second;
+  assert(decryptor->mNumSessions > 0);
+  if (!--decryptor->mNumSessions) {
+    mDecryptors.erase(it);
+    // May not delete the decryptor yet, if it's decrypting a sample.
+    decryptor->Release();
   }
 }
 
@@ -142,14 +206,26 @@ ClearKeyDecryptionManager::Decrypt(uint8_t* aBuffer, uint32_t aBufferSize,
                                    const CryptoMetaData& aMetadata)
 {
   CK_LOGD("ClearKeyDecryptionManager::Decrypt");
-  if (!HasKeyForKeyId(aMetadata.mKeyId)) {
-    return GMPNoKeyErr;
+  ClearKeyDecryptor* decryptor;
+  {
+    AutoLock lock(mMutex);
+    auto it = mDecryptors.find(aMetadata.mKeyId);
+    if (it == mDecryptors.end() || !it->second->HasKey()) {
+      return GMPNoKeyErr;
+    }
+    // Hold a reference so the decryptor outlives its session being closed
+    // on another thread while we decrypt.
+    decryptor = it->second;
+    decryptor->AddRef();
   }
 
-  return mDecryptors[aMetadata.mKeyId]->Decrypt(aBuffer, aBufferSize, aMetadata);
+  GMPErr rv = decryptor->Decrypt(aBuffer, aBufferSize, aMetadata);
+  decryptor->Release();
+  return rv;
 }
 
 ClearKeyDecryptor::ClearKeyDecryptor()
+  : mNumSessions(0)
 {
   CK_LOGD("ClearKeyDecryptor ctor");
 }
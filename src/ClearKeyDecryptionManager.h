@@ -80,9 +80,16 @@ public:
   const Key& GetDecryptionKey(const KeyId& aKeyId);
 
   // Create a decryptor for the given KeyId if one does not already exist.
-  void InitKey(KeyId aKeyId, Key aKey);
+  // Returns true if the key was installed, which it is only if aKeyId is
+  // expected and doesn't have a key yet.
+  bool InitKey(KeyId aKeyId, Key aKey);
+  // Takes back the keys installed for aKeyIds, which are still expected.
+  // Samples already being decrypted with them are unaffected.
+  void RemoveKeys(const std::vector<KeyId>& aKeyIds);
   void ExpectKeyId(KeyId aKeyId);
   void ReleaseKeyId(KeyId aKeyId);
+  // As ReleaseKeyId() for each of aKeyIds, taking the lock once.
+  void ReleaseKeyIds(const std::vector<KeyId>& aKeyIds);
 
   // Decrypts buffer *in place*.
   GMPErr Decrypt(uint8_t* aBuffer, uint32_t aBufferSize,
@@ -94,7 +101,11 @@ public:
 
 private:
   bool IsExpectingKeyForKeyId(const KeyId& aKeyId) const;
+  void ReleaseKeyIdLocked(const KeyId& aKeyId);
 
+  // Decryptors are used on the decrypt thread while sessions come and go on
+  // the main thread, so mDecryptors is guarded by mMutex.
+  GMPMutex* mMutex;
   std::map<KeyId, ClearKeyDecryptor*> mDecryptors;
 };
 
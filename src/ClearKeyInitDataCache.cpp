@@ -0,0 +1,92 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "ClearKeyInitDataCache.h"
+
+using namespace std;
+
+static uint32_t
+HashBytes(uint32_t aHash, const uint8_t* aData, size_t aLength)
+{
+  // 32 bit FNV-1a.
+  for (size_t i = 0; i < aLength; i++) {
+    aHash = (aHash ^ aData[i]) * 16777619u;
+  }
+  return aHash;
+}
+
+/* static */ uint32_t
+ClearKeyInitDataCache::Hash(const string& aInitDataType,
+                            const uint8_t* aInitData, uint32_t aInitDataSize,
+                            GMPSessionType aSessionType)
+{
+  uint8_t sessionType = aSessionType;
+  uint32_t hash = HashBytes(2166136261u, &sessionType, 1);
+  hash = HashBytes(hash, (const uint8_t*)aInitDataType.data(),
+                   aInitDataType.size());
+  return HashBytes(hash, aInitData, aInitDataSize);
+}
+
+const ClearKeyInitDataCache::Entry*
+ClearKeyInitDataCache::Lookup(const string& aInitDataType,
+                              const uint8_t* aInitData, uint32_t aInitDataSize,
+                              GMPSessionType aSessionType)
+{
+  uint32_t hash = Hash(aInitDataType, aInitData, aInitDataSize, aSessionType);
+
+  for (auto it = mEntries.begin(); it != mEntries.end(); it++) {
+    if (it->mHash != hash ||
+        it->mSessionType != aSessionType ||
+        it->mInitData.size() != aInitDataSize ||
+        it->mInitDataType != aInitDataType ||
+        (aInitDataSize && memcmp(&it->mInitData[0], aInitData, aInitDataSize))) {
+      continue;
+    }
+
+    CK_LOGD("ClearKeyInitDataCache hit");
+    mEntries.splice(mEntries.begin(), mEntries, it);
+    return &mEntries.front();
+  }
+
+  return nullptr;
+}
+
+const ClearKeyInitDataCache::Entry*
+ClearKeyInitDataCache::Insert(const string& aInitDataType,
+                              const uint8_t* aInitData, uint32_t aInitDataSize,
+                              GMPSessionType aSessionType,
+                              const vector<KeyId>& aKeyIds,
+                              string aRequest)
+{
+  if (mEntries.size() >= CLEARKEY_INIT_DATA_CACHE_SIZE) {
+    // Reuse the least recently used entry.
+    mEntries.splice(mEntries.begin(), mEntries, --mEntries.end());
+  } else {
+    mEntries.push_front(CachedInitData());
+  }
+
+  CachedInitData& entry = mEntries.front();
+  entry.mHash = Hash(aInitDataType, aInitData, aInitDataSize, aSessionType);
+  entry.mSessionType = aSessionType;
+  entry.mInitDataType = aInitDataType;
+  Assign(entry.mInitData, aInitData, aInitDataSize);
+  entry.mKeyIds = aKeyIds;
+  entry.mRequest = move(aRequest);
+
+  return &entry;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ClearKeyInitDataCache_h__
+#define __ClearKeyInitDataCache_h__
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "ClearKeyUtils.h"
+#include "gmp-api/gmp-decryption.h"
+
+// Number of distinct init data the init data cache remembers.
+#ifndef CLEARKEY_INIT_DATA_CACHE_SIZE
+#define CLEARKEY_INIT_DATA_CACHE_SIZE 16
+#endif
+
+// Remembers the key IDs parsed out of recently used init data, and the
+// license request made for them, so that sessions created with identical
+// init data needn't parse it or build the request again. Entries are evicted
+// least recently used first. Main thread only.
+class ClearKeyInitDataCache
+{
+public:
+  struct Entry
+  {
+    std::vector<KeyId> mKeyIds;
+    std::string mRequest;
+  };
+
+  // Returns the entry for the init data, or nullptr if it isn't cached. The
+  // entry is valid until the next call to Insert().
+  const Entry* Lookup(const std::string& aInitDataType,
+                      const uint8_t* aInitData, uint32_t aInitDataSize,
+                      GMPSessionType aSessionType);
+
+  // Caches the key IDs and request for successfully parsed init data, and
+  // returns the new entry.
+  const Entry* Insert(const std::string& aInitDataType,
+                      const uint8_t* aInitData, uint32_t aInitDataSize,
+                      GMPSessionType aSessionType,
+                      const std::vector<KeyId>& aKeyIds,
+                      std::string aRequest);
+
+private:
+  struct CachedInitData : public Entry
+  {
+    uint32_t mHash;
+    GMPSessionType mSessionType;
+    std::string mInitDataType;
+    std::vector<uint8_t> mInitData;
+  };
+
+  static uint32_t Hash(const std::string& aInitDataType,
+                       const uint8_t* aInitData, uint32_t aInitDataSize,
+                       GMPSessionType aSessionType);
+
+  // Most recently used first.
+  std::list<CachedInitData> mEntries;
+};
+
+#endif // __ClearKeyInitDataCache_h__
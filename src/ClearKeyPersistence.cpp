@@ -15,16 +15,19 @@
  */
 
 #include "ClearKeyPersistence.h"
+#include "ClearKeyRecord.h"
 #include "ClearKeyUtils.h"
 #include "ClearKeyStorage.h"
 #include "ClearKeySessionManager.h"
 #include "RefCounted.h"
+#include "gmp-task-utils.h"
 
 #include <stdint.h>
 #include <string.h>
-#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <sstream>
 #include <assert.h>
 
 using namespace std;
@@ -39,10 +42,325 @@ static PersistentKeyState sPersistentKeyState = UNINITIALIZED;
 
 // Set of session Ids of the persistent sessions created or residing in
 // storage.
-static set<uint32_t> sPersistentSessionIds;
+static unordered_set<uint32_t> sPersistentSessionIds;
 
 static vector<GMPTask*> sTasksBlockedOnSessionIdLoad;
 
+// Record listing the ids of the persistent sessions whose records have been
+// stored, so they can be loaded at startup with one read rather than by
+// enumerating every record. Not a valid session id, so never mistaken for
+// a session's record.
+static const char kSessionIndexRecordName[] = "clearkey-session-index";
+
+// The ids listed in the session index record, or to be listed once it's
+// been written. Unlike sPersistentSessionIds this excludes ids of sessions
+// which haven't stored any keys yet.
+static unordered_set<uint32_t> sIndexedSessionIds;
+
+// The ids in sIndexedSessionIds which the index record mightn't list yet.
+// A session's records are only written once the index lists it, so that
+// however a crash interrupts us, every stored session is in the index, and
+// its id is never handed out again.
+static unordered_set<uint32_t> sIndexingSessionIds;
+
+// Temporary sessions are never stored, so their ids are allocated from a
+// range disjoint from that of persistent sessions. That way, creating them
+// needn't wait for the persistent session ids to be loaded.
+static const uint32_t kFirstTemporarySessionId = 0x80000000;
+
+struct PendingLoad;
+
+// An ExportSessions() call, reading the sessions' records
+// CLEARKEY_MAX_EXPORT_READS at a time. Deletes itself when done.
+class SessionExport {
+public:
+  explicit SessionExport(SessionExportContinuation* aContinuation);
+
+  void LoadSessions();
+  void SessionLoaded(GMPErr aStatus,
+                     uint32_t aSessionId,
+                     const StoredSession& aSession);
+
+private:
+  void Finish();
+  void Report();
+
+  SessionExportContinuation* mContinuation;
+  vector<uint32_t> mSessionIds;
+  size_t mNextSession;
+  uint32_t mNumLoading;
+  bool mLoading;
+  GMPErr mStatus;
+  vector<ExportedSession> mSessions;
+  vector<uint8_t> mBlob;
+};
+
+// A LoadSession() call, the reload of an evicted session's keys, or an
+// export, waiting for a session's records to be read.
+struct PendingLoad {
+  RefPtr<ClearKeySessionManager> mTarget;
+  uint32_t mPromiseId;
+  bool mIsRestore;
+  SessionExport* mExport;
+};
+
+static void
+CompleteLoad(const PendingLoad& aLoad,
+             GMPErr aStatus,
+             uint32_t aSessionId,
+             const StoredSession& aSession)
+{
+  if (aLoad.mExport) {
+    aLoad.mExport->SessionLoaded(aStatus, aSessionId, aSession);
+  } else if (aLoad.mIsRestore) {
+    aLoad.mTarget->EvictedSessionDataLoaded(aStatus, aSessionId, aSession);
+  } else {
+    aLoad.mTarget->PersistentSessionDataLoaded(aStatus, aLoad.mPromiseId,
+                                               aSessionId, aSession);
+  }
+}
+
+// A persistent session's records, either held in memory or being read.
+struct LoadedRecord {
+  LoadedRecord() : mReading(true), mStale(false) {}
+
+  bool mReading;
+  // Set if the records were rewritten while being read.
+  bool mStale;
+  StoredSession mSession;
+  std::vector<PendingLoad> mPendingLoads;
+};
+
+static unordered_map<uint32_t, LoadedRecord> sLoadedRecords;
+
+// Sessions waiting to be preloaded, and the number of preload reads in
+// flight.
+static deque<uint32_t> sPreloadQueue;
+static uint32_t sNumPreloadReads = 0;
+
+static void PreloadRecords();
+
+// Adds aKeyData's (key ID, key) pairs to aKeys, replacing any keys already
+// there with the same key ID.
+static void
+AddStoredKeys(vector<KeyIdPair>& aKeys,
+              const uint8_t* aKeyData,
+              uint32_t aKeyDataSize)
+{
+  for (uint32_t i = 0; i + 2 * CLEARKEY_KEY_LEN <= aKeyDataSize;
+       i += 2 * CLEARKEY_KEY_LEN) {
+    const uint8_t* keyId = aKeyData + i;
+    const uint8_t* key = keyId + CLEARKEY_KEY_LEN;
+
+    KeyIdPair* pair = nullptr;
+    for (size_t j = 0; j < aKeys.size() && !pair; j++) {
+      if (!memcmp(aKeys[j].mKeyId.data(), keyId, CLEARKEY_KEY_LEN)) {
+        pair = &aKeys[j];
+      }
+    }
+    if (!pair) {
+      aKeys.push_back(KeyIdPair());
+      pair = &aKeys.back();
+      Assign(pair->mKeyId, keyId, CLEARKEY_KEY_LEN);
+    }
+    Assign(pair->mKey, key, CLEARKEY_KEY_LEN);
+  }
+}
+
+// Reads a session's snapshot record, then its journal entries in order until
+// one is missing or from another epoch. Deletes itself when done.
+class LoadRecordFlow : public StorageFlow {
+public:
+  LoadRecordFlow(uint32_t aSessionId, bool aIsPreload)
+    : mSessionId(aSessionId)
+    , mIsPreload(aIsPreload)
+    , mJournalIndex(0)
+  {
+  }
+
+  void Start()
+  {
+    Read(ClearKeyUtils::SessionIdToString(mSessionId));
+  }
+
+  virtual void OnRead(GMPErr aStatus,
+                      const uint8_t* aData,
+                      uint32_t aLength) override
+  {
+    auto itr = sLoadedRecords.find(mSessionId);
+    assert(itr != sLoadedRecords.end() && itr->second.mReading);
+    StoredSession& session = itr->second.mSession;
+
+    GMPErr status = aStatus;
+    if (GMP_SUCCEEDED(status) && !mJournalIndex) {
+      vector<uint8_t> buffer;
+      const uint8_t* keyData = nullptr;
+      uint32_t keyDataSize = 0;
+      if (!DecodeSessionRecord(aData, aLength, buffer,
+                               &keyData, &keyDataSize, &session.mEpoch,
+                               &session.mExpiration)) {
+        status = GMPGenericErr;
+      } else {
+        AddStoredKeys(session.mKeys, keyData, keyDataSize);
+      }
+    } else if (GMP_SUCCEEDED(status)) {
+      const uint8_t* keyData = nullptr;
+      uint32_t keyDataSize = 0;
+      if (DecodeJournalEntry(aData, aLength, session.mEpoch,
+                             &keyData, &keyDataSize, &session.mExpiration)) {
+        AddStoredKeys(session.mKeys, keyData, keyDataSize);
+        session.mJournalLength = mJournalIndex;
+      } else {
+        // Past the end of the journal.
+        Done(status);
+        return;
+      }
+    }
+
+    if (GMP_FAILED(status) || mJournalIndex == CLEARKEY_MAX_JOURNAL_ENTRIES) {
+      Done(status);
+      return;
+    }
+
+    mJournalIndex++;
+    Read(ClearKeyPersistence::JournalRecordName(mSessionId, mJournalIndex));
+  }
+
+  virtual void OnWritten(GMPErr aStatus) override
+  {
+    assert(false); // Should not reach here.
+  }
+
+private:
+  void Done(GMPErr aStatus)
+  {
+    auto itr = sLoadedRecords.find(mSessionId);
+
+    vector<PendingLoad> pendingLoads;
+    pendingLoads.swap(itr->second.mPendingLoads);
+
+    // Keep our own copy, since the loaded record may be discarded.
+    StoredSession session;
+    if (GMP_SUCCEEDED(aStatus)) {
+      session = itr->second.mSession;
+    }
+
+    if (GMP_FAILED(aStatus) ||
+        itr->second.mStale ||
+        sLoadedRecords.size() > CLEARKEY_MAX_PRELOADED_SESSIONS) {
+      // Failed reads will be retried by the next LoadSession().
+      sLoadedRecords.erase(itr);
+    } else {
+      itr->second.mReading = false;
+    }
+
+    for (size_t i = 0; i < pendingLoads.size(); i++) {
+      CompleteLoad(pendingLoads[i], aStatus, mSessionId, session);
+    }
+
+    if (mIsPreload) {
+      sNumPreloadReads--;
+      PreloadRecords();
+    }
+
+    delete this;
+  }
+
+  uint32_t mSessionId;
+  bool mIsPreload;
+  uint32_t mJournalIndex;
+};
+
+static void
+ReadRecord(uint32_t aSessionId, bool aIsPreload, const PendingLoad* aLoad)
+{
+  assert(!Contains(sLoadedRecords, aSessionId));
+  LoadedRecord& record = sLoadedRecords[aSessionId];
+  if (aLoad) {
+    record.mPendingLoads.push_back(*aLoad);
+  }
+  (new LoadRecordFlow(aSessionId, aIsPreload))->Start();
+}
+
+static void
+PreloadRecords()
+{
+  // Reads that fail immediately call back in here; let the outer call keep
+  // going instead.
+  static bool sPreloading = false;
+  if (sPreloading) {
+    return;
+  }
+  sPreloading = true;
+
+  while (sNumPreloadReads < CLEARKEY_MAX_PRELOAD_READS &&
+         !sPreloadQueue.empty()) {
+    uint32_t sessionId = sPreloadQueue.front();
+    sPreloadQueue.pop_front();
+
+    // Skip sessions which have since been removed, or already loaded.
+    if (!Contains(sPersistentSessionIds, sessionId) ||
+        Contains(sLoadedRecords, sessionId)) {
+      continue;
+    }
+
+    sNumPreloadReads++;
+    ReadRecord(sessionId, true, nullptr);
+  }
+
+  sPreloading = false;
+}
+
+static void
+EncodeIndexRecord(vector<uint8_t>& aOutRecord)
+{
+  vector<uint32_t> sessionIds(sIndexedSessionIds.begin(),
+                              sIndexedSessionIds.end());
+  EncodeSessionIndex(sessionIds, aOutRecord);
+}
+
+static void
+SessionIndexWritten(bool aSucceeded)
+{
+  if (!aSucceeded) {
+    CK_LOGW("ClearKey CDM failed to write session index");
+  }
+}
+
+// Rewrites the whole index; StoreData() coalesces a burst of changes into
+// one write.
+static void
+WriteSessionIndex()
+{
+  vector<uint8_t> record;
+  EncodeIndexRecord(record);
+  StoreData(kSessionIndexRecordName, record,
+            WrapTaskNM(&SessionIndexWritten, true),
+            WrapTaskNM(&SessionIndexWritten, false));
+}
+
+static void
+SessionIdsLoaded()
+{
+  sPersistentKeyState = LOADED;
+
+  if (CLEARKEY_MAX_PRELOAD_READS > 0) {
+    for (auto it = sPersistentSessionIds.begin();
+         it != sPersistentSessionIds.end() &&
+         sPreloadQueue.size() < CLEARKEY_MAX_PRELOADED_SESSIONS;
+         it++) {
+      sPreloadQueue.push_back(*it);
+    }
+    PreloadRecords();
+  }
+
+  for (size_t i = 0; i < sTasksBlockedOnSessionIdLoad.size(); i++) {
+    sTasksBlockedOnSessionIdLoad[i]->Run();
+    sTasksBlockedOnSessionIdLoad[i]->Destroy();
+  }
+  sTasksBlockedOnSessionIdLoad.clear();
+}
+
 static void
 ReadAllRecordsFromIterator(GMPRecordIterator* aRecordIterator,
                            void* aUserArg,
@@ -55,54 +373,78 @@ ReadAllRecordsFromIterator(GMPRecordIterator* aRecordIterator,
     const char* name = nullptr;
     uint32_t len = 0;
     while (GMP_SUCCEEDED(aRecordIterator->GetName(&name, &len))) {
-      if (ClearKeyUtils::IsValidSessionId(name, len)) {
-        assert(name[len] == 0);
-        sPersistentSessionIds.insert(atoi(name));
+      uint32_t sessionId;
+      if (ClearKeyUtils::ParseSessionId(name, len, sessionId)) {
+        sPersistentSessionIds.insert(sessionId);
+        sIndexedSessionIds.insert(sessionId);
       }
       aRecordIterator->NextRecord();
     }
-  }
-  sPersistentKeyState = LOADED;
-  aRecordIterator->Close();
+    aRecordIterator->Close();
 
-  for (size_t i = 0; i < sTasksBlockedOnSessionIdLoad.size(); i++) {
-    sTasksBlockedOnSessionIdLoad[i]->Run();
-    sTasksBlockedOnSessionIdLoad[i]->Destroy();
+    // Rebuild the index so we needn't enumerate next time.
+    WriteSessionIndex();
   }
-  sTasksBlockedOnSessionIdLoad.clear();
+
+  SessionIdsLoaded();
 }
 
+class ReadSessionIndexTask : public ReadContinuation {
+public:
+  virtual void ReadComplete(GMPErr aStatus,
+                            const uint8_t* aData,
+                            uint32_t aLength) override
+  {
+    assert(sPersistentKeyState == LOADING);
+
+    vector<uint32_t> sessionIds;
+    if (GMP_SUCCEEDED(aStatus) &&
+        DecodeSessionIndex(aData, aLength, sessionIds)) {
+      sPersistentSessionIds.insert(sessionIds.begin(), sessionIds.end());
+      sIndexedSessionIds.insert(sessionIds.begin(), sessionIds.end());
+      SessionIdsLoaded();
+      return;
+    }
+
+    // There's no usable index, for example because the sessions were stored
+    // by an older version; fall back to enumerating the records.
+    CK_LOGD("ClearKey CDM enumerating records to rebuild session index");
+    if (GMP_FAILED(EnumRecordNames(&ReadAllRecordsFromIterator))) {
+      SessionIdsLoaded();
+    }
+  }
+};
+
 /* static */ void
 ClearKeyPersistence::EnsureInitialized()
 {
   if (sPersistentKeyState == UNINITIALIZED) {
     sPersistentKeyState = LOADING;
-    if (GMP_FAILED(EnumRecordNames(&ReadAllRecordsFromIterator))) {
-      sPersistentKeyState = LOADED;
-    }
+    ReadData(kSessionIndexRecordName, new ReadSessionIndexTask());
   }
 }
 
-/* static */ string
+/* static */ uint32_t
 ClearKeyPersistence::GetNewSessionId(GMPSessionType aSessionType)
 {
   static uint32_t sNextSessionId = 1;
+  static uint32_t sNextTemporarySessionId = kFirstTemporarySessionId;
 
-  // Ensure we don't re-use a session id that was persisted.
-  while (Contains(sPersistentSessionIds, sNextSessionId)) {
-    sNextSessionId++;
+  if (aSessionType != kGMPPersistentSession) {
+    assert(sNextTemporarySessionId >= kFirstTemporarySessionId);
+    return sNextTemporarySessionId++;
   }
 
-  string sessionId;
-  stringstream ss;
-  ss << sNextSessionId;
-  ss >> sessionId;
-
-  if (aSessionType == kGMPPersistentSession) {
-    sPersistentSessionIds.insert(sNextSessionId);
+  // Ensure we don't re-use a session id that was persisted. Ids are never
+  // reused, so each persisted id is skipped over at most once.
+  assert(sPersistentKeyState == LOADED);
+  while (Contains(sPersistentSessionIds, sNextSessionId)) {
+    sNextSessionId++;
   }
 
-  sNextSessionId++;
+  uint32_t sessionId = sNextSessionId++;
+  assert(sessionId < kFirstTemporarySessionId);
+  sPersistentSessionIds.insert(sessionId);
 
   return sessionId;
 }
@@ -158,7 +500,8 @@ ClearKeyPersistence::DeferCreateSessionIfNotReady(ClearKeySessionManager* aInsta
                                                   uint32_t aInitDataSize,
                                                   GMPSessionType aSessionType)
 {
-  if (sPersistentKeyState >= LOADED)  {
+  if (sPersistentKeyState >= LOADED ||
+      aSessionType != kGMPPersistentSession) {
     return false;
   }
   GMPTask* t = new CreateSessionTask(aInstance,
@@ -215,46 +558,427 @@ ClearKeyPersistence::DeferLoadSessionIfNotReady(ClearKeySessionManager* aInstanc
 }
 
 /* static */ bool
-ClearKeyPersistence::IsPersistentSessionId(const string& aSessionId)
+ClearKeyPersistence::IsPersistentSessionId(uint32_t aSessionId)
 {
-  return Contains(sPersistentSessionIds, atoi(aSessionId.c_str()));
+  return Contains(sPersistentSessionIds, aSessionId);
 }
 
-class LoadSessionFromKeysTask : public ReadContinuation {
+static void
+LoadStoredSession(uint32_t aSid, const PendingLoad& aLoad)
+{
+  auto itr = sLoadedRecords.find(aSid);
+  if (itr == sLoadedRecords.end()) {
+    ReadRecord(aSid, false, &aLoad);
+    return;
+  }
+
+  if (itr->second.mReading) {
+    // Already being read, most likely by the preload; wait for it.
+    itr->second.mPendingLoads.push_back(aLoad);
+    return;
+  }
+
+  CK_LOGD("ClearKeyPersistence loaded session %u from memory", aSid);
+  CompleteLoad(aLoad, GMPNoErr, aSid, itr->second.mSession);
+}
+
+/* static */ void
+ClearKeyPersistence::LoadSessionData(ClearKeySessionManager* aInstance,
+                                     uint32_t aSid,
+                                     uint32_t aPromiseId)
+{
+  PendingLoad load;
+  load.mTarget = aInstance;
+  load.mPromiseId = aPromiseId;
+  load.mIsRestore = false;
+  load.mExport = nullptr;
+  LoadStoredSession(aSid, load);
+}
+
+/* static */ void
+ClearKeyPersistence::RestoreSessionData(ClearKeySessionManager* aInstance,
+                                        uint32_t aSid)
+{
+  PendingLoad load;
+  load.mTarget = aInstance;
+  load.mPromiseId = 0;
+  load.mIsRestore = true;
+  load.mExport = nullptr;
+  LoadStoredSession(aSid, load);
+}
+
+SessionExport::SessionExport(SessionExportContinuation* aContinuation)
+  : mContinuation(aContinuation)
+  , mSessionIds(sIndexedSessionIds.begin(), sIndexedSessionIds.end())
+  , mNextSession(0)
+  , mNumLoading(0)
+  , mLoading(false)
+  , mStatus(GMPNoErr)
+{
+}
+
+void
+SessionExport::LoadSessions()
+{
+  // Records in memory complete their loads immediately, calling back in
+  // here; let the outer call keep going instead.
+  if (mLoading) {
+    return;
+  }
+  mLoading = true;
+
+  while (GMP_SUCCEEDED(mStatus) &&
+         mNumLoading < CLEARKEY_MAX_EXPORT_READS &&
+         mNextSession < mSessionIds.size()) {
+    PendingLoad load;
+    load.mPromiseId = 0;
+    load.mIsRestore = false;
+    load.mExport = this;
+    mNumLoading++;
+    LoadStoredSession(mSessionIds[mNextSession++], load);
+  }
+
+  mLoading = false;
+
+  if (!mNumLoading &&
+      (GMP_FAILED(mStatus) || mNextSession == mSessionIds.size())) {
+    Finish();
+  }
+}
+
+void
+SessionExport::SessionLoaded(GMPErr aStatus,
+                             uint32_t aSessionId,
+                             const StoredSession& aSession)
+{
+  assert(mNumLoading > 0);
+  mNumLoading--;
+
+  if (GMP_FAILED(aStatus)) {
+    CK_LOGE("ClearKey CDM failed to read session %u for export", aSessionId);
+    mStatus = aStatus;
+  } else if (!aSession.mKeys.empty()) {
+    mSessions.push_back(ExportedSession());
+    mSessions.back().mSessionId = aSessionId;
+    mSessions.back().mExpiration = aSession.mExpiration;
+    vector<uint8_t>& keyData = mSessions.back().mKeyData;
+    for (size_t i = 0; i < aSession.mKeys.size(); i++) {
+      const KeyIdPair& pair = aSession.mKeys[i];
+      keyData.insert(keyData.end(), pair.mKeyId.begin(), pair.mKeyId.end());
+      keyData.insert(keyData.end(), pair.mKey.begin(), pair.mKey.end());
+    }
+  }
+
+  LoadSessions();
+}
+
+void
+SessionExport::Finish()
+{
+  if (GMP_SUCCEEDED(mStatus)) {
+    EncodeSessionExport(mSessions, mBlob);
+    CK_LOGD("ClearKey CDM exported %u sessions in %u bytes",
+            (uint32_t)mSessions.size(), (uint32_t)mBlob.size());
+  }
+  // When every record was in memory we're still inside ExportSessions().
+  GetPlatform()->runonmainthread(WrapTask(this, &SessionExport::Report));
+}
+
+void
+SessionExport::Report()
+{
+  mContinuation->ExportComplete(mStatus, mBlob.data(), mBlob.size());
+  delete mContinuation;
+  delete this;
+}
+
+/* static */ void
+ClearKeyPersistence::ExportSessions(SessionExportContinuation* aContinuation)
+{
+  assert(aContinuation);
+
+  EnsureInitialized();
+  if (sPersistentKeyState != LOADED) {
+    sTasksBlockedOnSessionIdLoad.push_back(
+      WrapTaskNM(&ClearKeyPersistence::ExportSessions, aContinuation));
+    return;
+  }
+
+  (new SessionExport(aContinuation))->LoadSessions();
+}
+
+class SessionImport;
+
+// Writes one of an import's records.
+class ImportRecordFlow : public SessionRecordFlow {
 public:
-  LoadSessionFromKeysTask(ClearKeySessionManager* aTarget,
-                          const string& aSessionId,
-                          uint32_t aPromiseId)
-    : mTarget(aTarget)
-    , mSessionId(aSessionId)
-    , mPromiseId(aPromiseId)
+  ImportRecordFlow(SessionImport* aImport,
+                   uint32_t aExportedId,
+                   uint32_t aSessionId,
+                   const vector<uint8_t>& aRecord);
+
+protected:
+  virtual void OnStored(bool aSucceeded) override;
+
+private:
+  RefPtr<SessionImport> mImport;
+  uint32_t mExportedId;
+  uint32_t mSessionId;
+};
+
+// An ImportSessions() call, waiting for the sessions' records to be
+// written. Each write's flow holds a reference.
+class SessionImport : public RefCounted {
+public:
+  explicit SessionImport(SessionImportContinuation* aContinuation)
+    : mContinuation(aContinuation)
+    , mNumWriting(0)
+    , mStatus(GMPNoErr)
   {
   }
 
-  virtual void ReadComplete(GMPErr aStatus,
-                            const uint8_t* aData,
-                            uint32_t aLength) override
+  void Start(const vector<ExportedSession>& aSessions)
   {
-    mTarget->PersistentSessionDataLoaded(aStatus, mPromiseId, mSessionId, aData, aLength);
+    GMPTimestamp now = 0;
+    GetPlatform()->getcurrenttime(&now);
+
+    // Writes which fail straight away report before their flow's Start()
+    // returns, so don't let them finish the import before every write has
+    // started.
+    mNumWriting++;
+
+    for (size_t i = 0; i < aSessions.size(); i++) {
+      uint32_t exportedId = aSessions[i].mSessionId;
+      uint32_t sessionId = exportedId;
+      if (!sPersistentSessionIds.insert(sessionId).second) {
+        // Every device counts its persistent session ids up from 1, so a
+        // blob from another one mostly collides with the sessions here.
+        sessionId = ClearKeyPersistence::GetNewSessionId(kGMPPersistentSession);
+        CK_LOGD("ClearKey CDM importing session %u as %u",
+                exportedId, sessionId);
+      }
+
+      // As in CreateSession(), start from an epoch which any stray journal
+      // entries are very unlikely to share.
+      vector<uint8_t> record;
+      EncodeSessionRecord(aSessions[i].mKeyData, (uint32_t)now,
+                          aSessions[i].mExpiration, record);
+      mNumWriting++;
+      (new ImportRecordFlow(this, exportedId, sessionId, record))->Start();
+    }
+
+    if (!--mNumWriting) {
+      Finish();
+    }
   }
+
+  void SessionWritten(uint32_t aExportedId,
+                      uint32_t aSessionId,
+                      bool aSucceeded)
+  {
+    assert(mNumWriting > 0);
+    mNumWriting--;
+
+    if (aSucceeded) {
+      mImported.push_back(ImportedSessionId(aExportedId, aSessionId));
+    } else {
+      // Leave the id in use, since we don't know what its record holds.
+      CK_LOGE("ClearKey CDM failed to import session %u", aSessionId);
+      mStatus = GMPGenericErr;
+    }
+
+    if (!mNumWriting) {
+      Finish();
+    }
+  }
+
+  void Fail()
+  {
+    mStatus = GMPGenericErr;
+    Finish();
+  }
+
 private:
-  RefPtr<ClearKeySessionManager> mTarget;
-  string mSessionId;
-  uint32_t mPromiseId;
+  ~SessionImport()
+  {
+    delete mContinuation;
+  }
+
+  // Reports from a task of its own, since with nothing to write we're
+  // still inside ImportSessions().
+  void Finish()
+  {
+    GetPlatform()->runonmainthread(
+      WrapTaskRefCounted(this, &SessionImport::Report));
+  }
+
+  void Report()
+  {
+    mContinuation->ImportComplete(mStatus, mImported);
+  }
+
+  SessionImportContinuation* mContinuation;
+  uint32_t mNumWriting;
+  GMPErr mStatus;
+  vector<ImportedSessionId> mImported;
 };
 
+ImportRecordFlow::ImportRecordFlow(SessionImport* aImport,
+                                   uint32_t aExportedId,
+                                   uint32_t aSessionId,
+                                   const vector<uint8_t>& aRecord)
+  : SessionRecordFlow(aSessionId,
+                      ClearKeyUtils::SessionIdToString(aSessionId),
+                      aRecord)
+  , mImport(aImport)
+  , mExportedId(aExportedId)
+  , mSessionId(aSessionId)
+{
+}
+
+void
+ImportRecordFlow::OnStored(bool aSucceeded)
+{
+  mImport->SessionWritten(mExportedId, mSessionId, aSucceeded);
+}
+
 /* static */ void
-ClearKeyPersistence::LoadSessionData(ClearKeySessionManager* aInstance,
-                                     const string& aSid,
-                                     uint32_t aPromiseId)
+ClearKeyPersistence::ImportSessions(const vector<uint8_t>& aBlob,
+                                    SessionImportContinuation* aContinuation)
+{
+  assert(aContinuation);
+
+  vector<ExportedSession> sessions;
+  bool valid = DecodeSessionExport(aBlob.data(), aBlob.size(), sessions);
+  for (size_t i = 0; valid && i < sessions.size(); i++) {
+    valid = sessions[i].mSessionId &&
+            sessions[i].mSessionId < kFirstTemporarySessionId;
+  }
+  RefPtr<SessionImport> import(new SessionImport(aContinuation));
+  if (!valid) {
+    CK_LOGE("ClearKey CDM can't import invalid session export");
+    import->Fail();
+    return;
+  }
+
+  EnsureInitialized();
+  if (sPersistentKeyState != LOADED) {
+    sTasksBlockedOnSessionIdLoad.push_back(
+      WrapTaskRefCounted(import.get(), &SessionImport::Start, sessions));
+    return;
+  }
+
+  import->Start(sessions);
+}
+
+/* static */ string
+ClearKeyPersistence::JournalRecordName(uint32_t aSid, uint32_t aIndex)
 {
-  LoadSessionFromKeysTask* loadTask =
-    new LoadSessionFromKeysTask(aInstance, aSid, aPromiseId);
-  ReadData(aSid, loadTask);
+  // Not a valid session id, so never mistaken for a snapshot record.
+  return ClearKeyUtils::SessionIdToString(aSid) + "-" +
+         ClearKeyUtils::SessionIdToString(aIndex);
+}
+
+static void
+InvalidateLoadedRecord(uint32_t aSessionId)
+{
+  auto itr = sLoadedRecords.find(aSessionId);
+  if (itr == sLoadedRecords.end()) {
+    return;
+  }
+
+  if (itr->second.mReading) {
+    itr->second.mStale = true;
+  } else {
+    sLoadedRecords.erase(itr);
+  }
 }
 
 /* static */ void
-ClearKeyPersistence::PersistentSessionRemoved(const string& aSessionId)
+ClearKeyPersistence::PersistentSessionRemoved(uint32_t aSessionId)
+{
+  sPersistentSessionIds.erase(aSessionId);
+  sIndexingSessionIds.erase(aSessionId);
+  if (sIndexedSessionIds.erase(aSessionId)) {
+    WriteSessionIndex();
+  }
+
+  InvalidateLoadedRecord(aSessionId);
+}
+
+SessionRecordFlow::SessionRecordFlow(uint32_t aSessionId,
+                                     const string& aRecordName,
+                                     const vector<uint8_t>& aData)
+  : mSessionId(aSessionId)
+  , mRecordName(aRecordName)
+  , mData(aData)
+  , mWritingIndex(false)
+{
+}
+
+void
+SessionRecordFlow::Start()
+{
+  InvalidateLoadedRecord(mSessionId);
+
+  if (Contains(sIndexedSessionIds, mSessionId) &&
+      !Contains(sIndexingSessionIds, mSessionId)) {
+    Write(mRecordName, mData);
+    return;
+  }
+
+  // Our write of the index may be coalesced with other sessions'; each
+  // lists every id added before it.
+  sIndexedSessionIds.insert(mSessionId);
+  sIndexingSessionIds.insert(mSessionId);
+  mWritingIndex = true;
+  vector<uint8_t> record;
+  EncodeIndexRecord(record);
+  Write(kSessionIndexRecordName, record);
+}
+
+void
+SessionRecordFlow::OnRead(GMPErr aStatus,
+                          const uint8_t* aData,
+                          uint32_t aLength)
+{
+  assert(false); // Should not reach here.
+}
+
+void
+SessionRecordFlow::OnWritten(GMPErr aStatus)
+{
+  if (!mWritingIndex) {
+    Done(GMP_SUCCEEDED(aStatus));
+    return;
+  }
+  mWritingIndex = false;
+
+  if (GMP_FAILED(aStatus)) {
+    CK_LOGW("ClearKey CDM failed to write session index");
+    // Leave the id out until the next write to the session's records, so
+    // that it tries writing the index again.
+    if (sIndexingSessionIds.erase(mSessionId)) {
+      sIndexedSessionIds.erase(mSessionId);
+    }
+    Done(false);
+    return;
+  }
+
+  if (!Contains(sIndexedSessionIds, mSessionId)) {
+    // The session was removed meanwhile; writing the record would bring it
+    // back.
+    Done(false);
+    return;
+  }
+
+  sIndexingSessionIds.erase(mSessionId);
+  Write(mRecordName, mData);
+}
+
+void
+SessionRecordFlow::Done(bool aSucceeded)
 {
-  sPersistentSessionIds.erase(atoi(aSessionId.c_str()));
+  OnStored(aSucceeded);
+  delete this;
 }
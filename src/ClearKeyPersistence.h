@@ -18,15 +18,74 @@
 #define __ClearKeyPersistence_h__
 
 #include <string>
+#include <utility>
+#include <vector>
+#include "ClearKeyStorage.h"
+#include "ClearKeyUtils.h"
 #include "gmp-api/gmp-decryption.h"
 
+// Once the persistent session ids have been enumerated, up to
+// CLEARKEY_MAX_PRELOADED_SESSIONS of their records are read into memory in
+// the background, CLEARKEY_MAX_PRELOAD_READS at a time, so that LoadSession()
+// needn't wait on storage. Set CLEARKEY_MAX_PRELOAD_READS to 0 to disable
+// preloading.
+#ifndef CLEARKEY_MAX_PRELOAD_READS
+#define CLEARKEY_MAX_PRELOAD_READS 4
+#endif
+#ifndef CLEARKEY_MAX_PRELOADED_SESSIONS
+#define CLEARKEY_MAX_PRELOADED_SESSIONS 256
+#endif
+
+// Once a persistent session's journal has this many entries, the next update
+// writes a new snapshot record of all its keys instead. See ClearKeyRecord.h.
+#ifndef CLEARKEY_MAX_JOURNAL_ENTRIES
+#define CLEARKEY_MAX_JOURNAL_ENTRIES 8
+#endif
+
+// Maximum number of session records ExportSessions() reads at once.
+#ifndef CLEARKEY_MAX_EXPORT_READS
+#define CLEARKEY_MAX_EXPORT_READS 16
+#endif
+
 class ClearKeySessionManager;
 
+// A persistent session's keys and expiration, read back from its snapshot
+// record and the journal entries that follow it.
+struct StoredSession {
+  StoredSession() : mEpoch(0), mJournalLength(0), mExpiration(0) {}
+
+  std::vector<KeyIdPair> mKeys;
+  uint32_t mEpoch;
+  uint32_t mJournalLength;
+  GMPTimestamp mExpiration;
+};
+
+class SessionExportContinuation {
+public:
+  virtual void ExportComplete(GMPErr aStatus,
+                              const uint8_t* aBlob,
+                              uint32_t aBlobSize) = 0;
+  virtual ~SessionExportContinuation() {}
+};
+
+// The id each imported session had in the blob, and the id it was stored
+// under here.
+typedef std::pair<uint32_t, uint32_t> ImportedSessionId;
+
+class SessionImportContinuation {
+public:
+  // aImported lists the sessions which were stored, even if others
+  // weren't.
+  virtual void ImportComplete(GMPErr aStatus,
+                              const std::vector<ImportedSessionId>& aImported) = 0;
+  virtual ~SessionImportContinuation() {}
+};
+
 class ClearKeyPersistence {
 public:
   static void EnsureInitialized();
 
-  static std::string GetNewSessionId(GMPSessionType aSessionType);
+  static uint32_t GetNewSessionId(GMPSessionType aSessionType);
 
   static bool DeferCreateSessionIfNotReady(ClearKeySessionManager* aInstance,
                                            uint32_t aCreateSessionToken,
@@ -41,13 +100,69 @@ public:
                                          const char* aSessionId,
                                          uint32_t aSessionIdLength);
 
-  static bool IsPersistentSessionId(const std::string& aSid);
+  static bool IsPersistentSessionId(uint32_t aSid);
 
+  // Name of a persistent session's aIndex'th journal entry record, counting
+  // from 1.
+  static std::string JournalRecordName(uint32_t aSid, uint32_t aIndex);
+
+  // Reads a persistent session's records, and reports them to
+  // aInstance->PersistentSessionDataLoaded().
   static void LoadSessionData(ClearKeySessionManager* aInstance,
-                              const std::string& aSid,
+                              uint32_t aSid,
                               uint32_t aPromiseId);
 
-  static void PersistentSessionRemoved(const std::string& aSid);
+  // As LoadSessionData(), but reports to
+  // aInstance->EvictedSessionDataLoaded().
+  static void RestoreSessionData(ClearKeySessionManager* aInstance,
+                                 uint32_t aSid);
+
+  // Encodes the keys of every stored persistent session with any into one
+  // blob; see EncodeSessionExport(). Records already read into memory
+  // aren't read again. Deletes aContinuation after running it, from a task
+  // of its own, to report the blob.
+  static void ExportSessions(SessionExportContinuation* aContinuation);
+
+  // Stores each session in a blob from ExportSessions() as a snapshot
+  // record, writing the session index and then all the records at once.
+  // Sessions whose ids are already in use here are stored under new ids.
+  // Deletes aContinuation after running it, from a task of its own, once
+  // every record is written or has failed to be.
+  static void ImportSessions(const std::vector<uint8_t>& aBlob,
+                             SessionImportContinuation* aContinuation);
+
+  // Must be called whenever a persistent session's records are deleted.
+  // Fails its writes still waiting on the session index.
+  static void PersistentSessionRemoved(uint32_t aSid);
+};
+
+// Writes one of a persistent session's records, once the session index
+// record lists the session, writing the index first if need be. If the
+// index can't be written, or the session is removed meanwhile, fails
+// without writing the record. Reports to OnStored(), then deletes itself.
+class SessionRecordFlow : public StorageFlow {
+public:
+  SessionRecordFlow(uint32_t aSid,
+                    const std::string& aRecordName,
+                    const std::vector<uint8_t>& aData);
+
+  void Start();
+
+  virtual void OnRead(GMPErr aStatus,
+                      const uint8_t* aData,
+                      uint32_t aLength) override;
+  virtual void OnWritten(GMPErr aStatus) override;
+
+protected:
+  virtual void OnStored(bool aSucceeded) = 0;
+
+private:
+  void Done(bool aSucceeded);
+
+  uint32_t mSessionId;
+  std::string mRecordName;
+  std::vector<uint8_t> mData;
+  bool mWritingIndex;
 };
 
 #endif // __ClearKeyPersistence_h__
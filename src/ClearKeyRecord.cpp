@@ -0,0 +1,454 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "ClearKeyRecord.h"
+#include "ClearKeyUtils.h"
+#include "Endian.h"
+#include "mozilla/lz4.h"
+
+#if defined(__x86_64__) || defined(__i386__) || \
+    defined(_M_X64) || defined(_M_IX86)
+#define CLEARKEY_HAVE_SSE42_CRC32C 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CLEARKEY_TARGET_SSE42
+#else
+#define CLEARKEY_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+using namespace std;
+using mozilla::BigEndian;
+
+#define FOURCC(a,b,c,d) ((a << 24) + (b << 16) + (c << 8) + d)
+
+static const uint32_t kRecordMagic = FOURCC('C','K','S','R');
+static const uint8_t kRecordVersion = 1;
+static const uint8_t kRecordCompressed = 1 << 0;
+
+static const size_t kRecordHeaderSize = 32;
+// Offset of the first byte covered by the CRC.
+static const size_t kRecordCRCStart = 8;
+
+static const size_t kKeyPairSize = 2 * CLEARKEY_KEY_LEN;
+
+static const uint32_t kIndexMagic = FOURCC('C','K','S','I');
+static const uint8_t kIndexVersion = 1;
+static const size_t kIndexHeaderSize = 16;
+
+static const uint32_t kExportMagic = FOURCC('C','K','S','X');
+static const uint8_t kExportVersion = 1;
+static const size_t kExportHeaderSize = 16;
+// Session ID, number of keys and expiration.
+static const size_t kExportSessionHeaderSize = 16;
+
+static const uint32_t kJournalMagic = FOURCC('C','K','S','J');
+static const uint8_t kJournalVersion = 1;
+static const size_t kJournalHeaderSize = 28;
+
+class CRC32CTable
+{
+public:
+  CRC32CTable()
+  {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      }
+      mTable[i] = crc;
+    }
+  }
+
+  uint32_t Update(uint32_t aCRC, const uint8_t* aData, size_t aLength) const
+  {
+    for (size_t i = 0; i < aLength; i++) {
+      aCRC = mTable[(aCRC ^ aData[i]) & 0xff] ^ (aCRC >> 8);
+    }
+    return aCRC;
+  }
+
+private:
+  uint32_t mTable[256];
+};
+
+#if defined(CLEARKEY_HAVE_SSE42_CRC32C)
+static bool
+HasSSE42()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return info[2] & (1 << 20);
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+CLEARKEY_TARGET_SSE42 static uint32_t
+UpdateCRC32CSSE42(uint32_t aCRC, const uint8_t* aData, size_t aLength)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t crc = aCRC;
+  for (; aLength >= 8; aData += 8, aLength -= 8) {
+    uint64_t word;
+    memcpy(&word, aData, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  aCRC = (uint32_t)crc;
+#else
+  for (; aLength >= 4; aData += 4, aLength -= 4) {
+    uint32_t word;
+    memcpy(&word, aData, sizeof(word));
+    aCRC = _mm_crc32_u32(aCRC, word);
+  }
+#endif
+  for (; aLength; aData++, aLength--) {
+    aCRC = _mm_crc32_u8(aCRC, *aData);
+  }
+  return aCRC;
+}
+#endif
+
+uint32_t
+ComputeCRC32C(const uint8_t* aData, size_t aLength)
+{
+  uint32_t crc = 0xffffffff;
+
+#if defined(CLEARKEY_HAVE_SSE42_CRC32C)
+  static const bool sHasSSE42 = HasSSE42();
+  if (sHasSSE42) {
+    return ~UpdateCRC32CSSE42(crc, aData, aLength);
+  }
+#endif
+
+  static const CRC32CTable sTable;
+  return ~sTable.Update(crc, aData, aLength);
+}
+
+void
+EncodeSessionRecord(const vector<uint8_t>& aKeyData,
+                    uint32_t aEpoch,
+                    int64_t aExpiration,
+                    vector<uint8_t>& aOutRecord)
+{
+  assert(aKeyData.size() % kKeyPairSize == 0);
+
+  uint8_t flags = 0;
+  size_t payloadSize = aKeyData.size();
+  aOutRecord.resize(kRecordHeaderSize + payloadSize);
+
+  if (payloadSize >= CLEARKEY_RECORD_MIN_COMPRESS_SIZE) {
+    // Only keep the compressed pairs if they're smaller.
+    int compressedSize =
+      LZ4_compress_limitedOutput((const char*)&aKeyData[0],
+                                 (char*)&aOutRecord[kRecordHeaderSize],
+                                 payloadSize,
+                                 payloadSize - 1);
+    if (compressedSize > 0) {
+      flags |= kRecordCompressed;
+      payloadSize = compressedSize;
+      aOutRecord.resize(kRecordHeaderSize + payloadSize);
+    }
+  }
+
+  if (!(flags & kRecordCompressed) && payloadSize) {
+    memcpy(&aOutRecord[kRecordHeaderSize], &aKeyData[0], payloadSize);
+  }
+
+  uint8_t* header = &aOutRecord[0];
+  BigEndian::writeUint32(header, kRecordMagic);
+  header[8] = kRecordVersion;
+  header[9] = flags;
+  BigEndian::writeUint16(header + 10, 0);
+  BigEndian::writeUint32(header + 12, aKeyData.size() / kKeyPairSize);
+  BigEndian::writeUint32(header + 16, payloadSize);
+  BigEndian::writeUint32(header + 20, aEpoch);
+  BigEndian::writeUint64(header + 24, aExpiration);
+  BigEndian::writeUint32(header + 4,
+                         ComputeCRC32C(header + kRecordCRCStart,
+                                       aOutRecord.size() - kRecordCRCStart));
+}
+
+bool
+DecodeSessionRecord(const uint8_t* aRecord, uint32_t aRecordSize,
+                    vector<uint8_t>& aBuffer,
+                    const uint8_t** aOutKeyData,
+                    uint32_t* aOutKeyDataSize,
+                    uint32_t* aOutEpoch,
+                    int64_t* aOutExpiration)
+{
+  if (aRecordSize < kRecordHeaderSize ||
+      BigEndian::readUint32(aRecord) != kRecordMagic) {
+    // Written before records had a header.
+    if (aRecordSize % kKeyPairSize) {
+      CK_LOGE("Session record isn't a whole number of keys");
+      return false;
+    }
+    *aOutKeyData = aRecord;
+    *aOutKeyDataSize = aRecordSize;
+    *aOutEpoch = 0;
+    *aOutExpiration = 0;
+    return true;
+  }
+
+  uint32_t crc = BigEndian::readUint32(aRecord + 4);
+  if (crc != ComputeCRC32C(aRecord + kRecordCRCStart,
+                           aRecordSize - kRecordCRCStart)) {
+    CK_LOGE("Session record failed CRC check");
+    return false;
+  }
+
+  uint8_t version = aRecord[8];
+  uint8_t flags = aRecord[9];
+  uint32_t numKeys = BigEndian::readUint32(aRecord + 12);
+  uint32_t payloadSize = BigEndian::readUint32(aRecord + 16);
+  const uint8_t* payload = aRecord + kRecordHeaderSize;
+
+  if (version != kRecordVersion ||
+      (flags & ~kRecordCompressed) ||
+      payloadSize != aRecordSize - kRecordHeaderSize ||
+      numKeys > UINT32_MAX / kKeyPairSize) {
+    CK_LOGE("Unsupported session record");
+    return false;
+  }
+
+  *aOutEpoch = BigEndian::readUint32(aRecord + 20);
+  *aOutExpiration = (int64_t)BigEndian::readUint64(aRecord + 24);
+  uint32_t keyDataSize = numKeys * kKeyPairSize;
+
+  if (!(flags & kRecordCompressed)) {
+    if (payloadSize != keyDataSize) {
+      return false;
+    }
+    *aOutKeyData = payload;
+    *aOutKeyDataSize = keyDataSize;
+    return true;
+  }
+
+  // LZ4 expands its input by at most a factor of 255, so a larger claimed
+  // size means the header is bad; don't allocate for it.
+  if (!keyDataSize || keyDataSize / 255 > payloadSize) {
+    return false;
+  }
+
+  aBuffer.resize(keyDataSize);
+  int decompressedSize =
+    LZ4_decompress_safe((const char*)payload, (char*)aBuffer.data(),
+                        payloadSize, keyDataSize);
+  if (decompressedSize < 0 || (uint32_t)decompressedSize != keyDataSize) {
+    CK_LOGE("Session record failed to decompress");
+    return false;
+  }
+
+  *aOutKeyData = aBuffer.data();
+  *aOutKeyDataSize = keyDataSize;
+  return true;
+}
+
+void
+EncodeSessionIndex(const vector<uint32_t>& aSessionIds,
+                   vector<uint8_t>& aOutRecord)
+{
+  aOutRecord.resize(kIndexHeaderSize + aSessionIds.size() * sizeof(uint32_t));
+
+  uint8_t* header = &aOutRecord[0];
+  BigEndian::writeUint32(header, kIndexMagic);
+  header[8] = kIndexVersion;
+  header[9] = 0;
+  BigEndian::writeUint16(header + 10, 0);
+  BigEndian::writeUint32(header + 12, aSessionIds.size());
+
+  uint8_t* ids = header + kIndexHeaderSize;
+  for (size_t i = 0; i < aSessionIds.size(); i++) {
+    BigEndian::writeUint32(ids + i * sizeof(uint32_t), aSessionIds[i]);
+  }
+
+  BigEndian::writeUint32(header + 4,
+                         ComputeCRC32C(header + kRecordCRCStart,
+                                       aOutRecord.size() - kRecordCRCStart));
+}
+
+bool
+DecodeSessionIndex(const uint8_t* aRecord, uint32_t aRecordSize,
+                   vector<uint32_t>& aOutSessionIds)
+{
+  if (aRecordSize < kIndexHeaderSize ||
+      BigEndian::readUint32(aRecord) != kIndexMagic ||
+      BigEndian::readUint32(aRecord + 4) !=
+        ComputeCRC32C(aRecord + kRecordCRCStart,
+                      aRecordSize - kRecordCRCStart)) {
+    return false;
+  }
+
+  uint32_t numSessions = BigEndian::readUint32(aRecord + 12);
+  if (aRecord[8] != kIndexVersion ||
+      aRecord[9] ||
+      numSessions != (aRecordSize - kIndexHeaderSize) / sizeof(uint32_t) ||
+      (aRecordSize - kIndexHeaderSize) % sizeof(uint32_t)) {
+    CK_LOGE("Unsupported session index");
+    return false;
+  }
+
+  const uint8_t* ids = aRecord + kIndexHeaderSize;
+  aOutSessionIds.reserve(aOutSessionIds.size() + numSessions);
+  for (uint32_t i = 0; i < numSessions; i++) {
+    aOutSessionIds.push_back(BigEndian::readUint32(ids + i * sizeof(uint32_t)));
+  }
+
+  return true;
+}
+
+void
+EncodeSessionExport(const vector<ExportedSession>& aSessions,
+                    vector<uint8_t>& aOutBlob)
+{
+  size_t blobSize = kExportHeaderSize;
+  for (size_t i = 0; i < aSessions.size(); i++) {
+    assert(aSessions[i].mKeyData.size() % kKeyPairSize == 0);
+    blobSize += kExportSessionHeaderSize + aSessions[i].mKeyData.size();
+  }
+  aOutBlob.resize(blobSize);
+
+  uint8_t* header = &aOutBlob[0];
+  BigEndian::writeUint32(header, kExportMagic);
+  header[8] = kExportVersion;
+  header[9] = 0;
+  BigEndian::writeUint16(header + 10, 0);
+  BigEndian::writeUint32(header + 12, aSessions.size());
+
+  uint8_t* p = header + kExportHeaderSize;
+  for (size_t i = 0; i < aSessions.size(); i++) {
+    const vector<uint8_t>& keyData = aSessions[i].mKeyData;
+    BigEndian::writeUint32(p, aSessions[i].mSessionId);
+    BigEndian::writeUint32(p + 4, keyData.size() / kKeyPairSize);
+    BigEndian::writeUint64(p + 8, aSessions[i].mExpiration);
+    p += kExportSessionHeaderSize;
+    if (!keyData.empty()) {
+      memcpy(p, &keyData[0], keyData.size());
+      p += keyData.size();
+    }
+  }
+
+  BigEndian::writeUint32(header + 4,
+                         ComputeCRC32C(header + kRecordCRCStart,
+                                       aOutBlob.size() - kRecordCRCStart));
+}
+
+bool
+DecodeSessionExport(const uint8_t* aBlob, uint32_t aBlobSize,
+                    vector<ExportedSession>& aOutSessions)
+{
+  if (aBlobSize < kExportHeaderSize ||
+      BigEndian::readUint32(aBlob) != kExportMagic ||
+      BigEndian::readUint32(aBlob + 4) !=
+        ComputeCRC32C(aBlob + kRecordCRCStart, aBlobSize - kRecordCRCStart)) {
+    CK_LOGE("Session export failed header or CRC check");
+    return false;
+  }
+
+  if (aBlob[8] != kExportVersion || aBlob[9]) {
+    CK_LOGE("Unsupported session export");
+    return false;
+  }
+
+  uint32_t numSessions = BigEndian::readUint32(aBlob + 12);
+  const uint8_t* p = aBlob + kExportHeaderSize;
+  const uint8_t* end = aBlob + aBlobSize;
+  vector<ExportedSession> sessions;
+  for (uint32_t i = 0; i < numSessions; i++) {
+    if ((size_t)(end - p) < kExportSessionHeaderSize) {
+      return false;
+    }
+    uint32_t sessionId = BigEndian::readUint32(p);
+    uint32_t numKeys = BigEndian::readUint32(p + 4);
+    int64_t expiration = (int64_t)BigEndian::readUint64(p + 8);
+    p += kExportSessionHeaderSize;
+    if (numKeys > (size_t)(end - p) / kKeyPairSize) {
+      return false;
+    }
+
+    sessions.push_back(ExportedSession());
+    sessions.back().mSessionId = sessionId;
+    sessions.back().mExpiration = expiration;
+    sessions.back().mKeyData.assign(p, p + numKeys * kKeyPairSize);
+    p += numKeys * kKeyPairSize;
+  }
+
+  if (p != end) {
+    return false;
+  }
+
+  aOutSessions.swap(sessions);
+  return true;
+}
+
+void
+EncodeJournalEntry(const vector<uint8_t>& aKeyData,
+                   uint32_t aEpoch,
+                   int64_t aExpiration,
+                   vector<uint8_t>& aOutRecord)
+{
+  assert(aKeyData.size() % kKeyPairSize == 0);
+
+  aOutRecord.resize(kJournalHeaderSize);
+  aOutRecord.insert(aOutRecord.end(), aKeyData.begin(), aKeyData.end());
+
+  uint8_t* header = &aOutRecord[0];
+  BigEndian::writeUint32(header, kJournalMagic);
+  header[8] = kJournalVersion;
+  header[9] = 0;
+  BigEndian::writeUint16(header + 10, 0);
+  BigEndian::writeUint32(header + 12, aEpoch);
+  BigEndian::writeUint32(header + 16, aKeyData.size() / kKeyPairSize);
+  BigEndian::writeUint64(header + 20, aExpiration);
+  BigEndian::writeUint32(header + 4,
+                         ComputeCRC32C(header + kRecordCRCStart,
+                                       aOutRecord.size() - kRecordCRCStart));
+}
+
+bool
+DecodeJournalEntry(const uint8_t* aRecord, uint32_t aRecordSize,
+                   uint32_t aEpoch,
+                   const uint8_t** aOutKeyData,
+                   uint32_t* aOutKeyDataSize,
+                   int64_t* aOutExpiration)
+{
+  if (aRecordSize < kJournalHeaderSize ||
+      BigEndian::readUint32(aRecord) != kJournalMagic ||
+      BigEndian::readUint32(aRecord + 4) !=
+        ComputeCRC32C(aRecord + kRecordCRCStart,
+                      aRecordSize - kRecordCRCStart)) {
+    return false;
+  }
+
+  uint32_t keyDataSize = aRecordSize - kJournalHeaderSize;
+  if (aRecord[8] != kJournalVersion ||
+      aRecord[9] ||
+      BigEndian::readUint32(aRecord + 12) != aEpoch ||
+      keyDataSize % kKeyPairSize ||
+      BigEndian::readUint32(aRecord + 16) != keyDataSize / kKeyPairSize) {
+    return false;
+  }
+
+  *aOutKeyData = aRecord + kJournalHeaderSize;
+  *aOutKeyDataSize = keyDataSize;
+  *aOutExpiration = (int64_t)BigEndian::readUint64(aRecord + 20);
+  return true;
+}
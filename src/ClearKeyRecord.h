@@ -0,0 +1,145 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ClearKeyRecord_h__
+#define __ClearKeyRecord_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Persistent session records. A session is stored as a snapshot record of
+// its keys, named after the session ID, and journal entry records of the
+// keys stored since the snapshot was written.
+//
+// A snapshot record is a header followed by the session's (key ID, key)
+// pairs, each CLEARKEY_KEY_LEN bytes, which are LZ4 compressed if that makes
+// them smaller. All fields are big endian:
+//
+//   uint32_t magic         'CKSR'
+//   uint32_t crc           CRC32C of everything after this field
+//   uint8_t  version       1
+//   uint8_t  flags         kRecordCompressed
+//   uint16_t reserved      0
+//   uint32_t numKeys
+//   uint32_t payloadSize   bytes of (possibly compressed) pairs that follow
+//   uint32_t epoch         journal entries from other epochs are stale
+//   int64_t  expiration    when the license expires, in ms since the Unix
+//                          epoch, or 0 if it doesn't
+//
+// Records written before this format are just the concatenated pairs. They
+// are in epoch 0, and don't expire.
+//
+// A journal entry record holds the (key ID, key) pairs added or changed by
+// one update to the session, uncompressed, and the session's expiration
+// after the update:
+//
+//   uint32_t magic         'CKSJ'
+//   uint32_t crc           CRC32C of everything after this field
+//   uint8_t  version       1
+//   uint8_t  flags         0
+//   uint16_t reserved      0
+//   uint32_t epoch         epoch of the snapshot this entry follows
+//   uint32_t numKeys
+//   int64_t  expiration
+
+// Payloads smaller than this aren't worth trying to compress.
+#ifndef CLEARKEY_RECORD_MIN_COMPRESS_SIZE
+#define CLEARKEY_RECORD_MIN_COMPRESS_SIZE 256
+#endif
+
+// Encodes aKeyData, concatenated (key ID, key) pairs, as a snapshot record.
+void EncodeSessionRecord(const std::vector<uint8_t>& aKeyData,
+                         uint32_t aEpoch,
+                         int64_t aExpiration,
+                         std::vector<uint8_t>& aOutRecord);
+
+// Checks and decodes a snapshot record. On success, aOutKeyData points to
+// aOutKeyDataSize bytes of concatenated (key ID, key) pairs, either in
+// aRecord or, if they had to be decompressed, in aBuffer.
+bool DecodeSessionRecord(const uint8_t* aRecord, uint32_t aRecordSize,
+                         std::vector<uint8_t>& aBuffer,
+                         const uint8_t** aOutKeyData,
+                         uint32_t* aOutKeyDataSize,
+                         uint32_t* aOutEpoch,
+                         int64_t* aOutExpiration);
+
+void EncodeJournalEntry(const std::vector<uint8_t>& aKeyData,
+                        uint32_t aEpoch,
+                        int64_t aExpiration,
+                        std::vector<uint8_t>& aOutRecord);
+
+// Checks and decodes a journal entry record. Fails if the entry isn't from
+// aEpoch. On success, aOutKeyData points into aRecord.
+bool DecodeJournalEntry(const uint8_t* aRecord, uint32_t aRecordSize,
+                        uint32_t aEpoch,
+                        const uint8_t** aOutKeyData,
+                        uint32_t* aOutKeyDataSize,
+                        int64_t* aOutExpiration);
+
+// The session index record lists the ids of the stored persistent sessions,
+// so they can be found at startup without enumerating every record:
+//
+//   uint32_t magic         'CKSI'
+//   uint32_t crc           CRC32C of everything after this field
+//   uint8_t  version       1
+//   uint8_t  flags         0
+//   uint16_t reserved      0
+//   uint32_t numSessions
+//   uint32_t sessionIds[numSessions]
+
+void EncodeSessionIndex(const std::vector<uint32_t>& aSessionIds,
+                        std::vector<uint8_t>& aOutRecord);
+
+bool DecodeSessionIndex(const uint8_t* aRecord, uint32_t aRecordSize,
+                        std::vector<uint32_t>& aOutSessionIds);
+
+// A session export blob holds every stored persistent session's keys, for
+// moving them to another device in one piece. The pairs are stored
+// uncompressed, since keys don't compress:
+//
+//   uint32_t magic         'CKSX'
+//   uint32_t crc           CRC32C of everything after this field
+//   uint8_t  version       1
+//   uint8_t  flags         0
+//   uint16_t reserved      0
+//   uint32_t numSessions
+//
+// followed by each session in turn:
+//
+//   uint32_t sessionId
+//   uint32_t numKeys
+//   int64_t  expiration    as in a snapshot record
+//   (key ID, key) pairs[numKeys]
+
+struct ExportedSession {
+  uint32_t mSessionId;
+  int64_t mExpiration;
+  // Concatenated (key ID, key) pairs.
+  std::vector<uint8_t> mKeyData;
+};
+
+void EncodeSessionExport(const std::vector<ExportedSession>& aSessions,
+                         std::vector<uint8_t>& aOutBlob);
+
+bool DecodeSessionExport(const uint8_t* aBlob, uint32_t aBlobSize,
+                         std::vector<ExportedSession>& aOutSessions);
+
+// CRC32C (Castagnoli), using the SSE4.2 crc32 instruction where the CPU has
+// it.
+uint32_t ComputeCRC32C(const uint8_t* aData, size_t aLength);
+
+#endif // __ClearKeyRecord_h__
@@ -26,10 +26,14 @@
 
 using namespace mozilla;
 
-ClearKeySession::ClearKeySession(const std::string& aSessionId,
+ClearKeySession::ClearKeySession(uint32_t aSessionId,
                                  GMPDecryptorCallback* aCallback,
                                  GMPSessionType aSessionType)
-  : mSessionId(aSessionId)
+  : mNumericId(aSessionId)
+  , mSessionId(ClearKeyUtils::SessionIdToString(aSessionId))
+  , mEvicted(false)
+  , mExpiration(0)
+  , mExpired(false)
   , mCallback(aCallback)
   , mSessionType(aSessionType)
 {
@@ -40,18 +44,22 @@ ClearKeySession::~ClearKeySession()
 {
   CK_LOGD("ClearKeySession dtor %p", this);
 
+  ClearKeyDecryptionManager* decryptionManager = ClearKeyDecryptionManager::Get();
+  KeyStatusBatch statuses(mCallback, mSessionId);
+
   auto& keyIds = GetKeyIds();
   for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
-    assert(ClearKeyDecryptionManager::Get()->HasSeenKeyId(*it));
-
-    ClearKeyDecryptionManager::Get()->ReleaseKeyId(*it);
-    mCallback->KeyStatusChanged(&mSessionId[0], mSessionId.size(),
-                                &(*it)[0], it->size(),
-                                kGMPUnknown);
+    if (!mEvicted && !mExpired) {
+      assert(decryptionManager->HasSeenKeyId(*it));
+      decryptionManager->ReleaseKeyId(*it);
+    }
+    statuses.Add(*it, kGMPUnknown);
   }
+
+  statuses.Flush();
 }
 
-void
+bool
 ClearKeySession::Init(uint32_t aCreateSessionToken,
                       uint32_t aPromiseId,
                       const std::string& aInitDataType,
@@ -65,20 +73,37 @@ ClearKeySession::Init(uint32_t aCreateSessionToken,
     std::string sessionType;
     ClearKeyUtils::ParseKeyIdsInitData(aInitData, aInitDataSize, mKeyIds, sessionType);
     if (sessionType != ClearKeyUtils::SessionTypeToString(mSessionType)) {
+      mKeyIds.clear();
       const char message[] = "Session type specified in keyids init data doesn't match session type.";
       mCallback->RejectPromise(aPromiseId, kGMPAbortError, message, strlen(message));
-      return;
+      return false;
     }
   }
 
   if (!mKeyIds.size()) {
     const char message[] = "Couldn't parse init data";
     mCallback->RejectPromise(aPromiseId, kGMPAbortError, message, strlen(message));
-    return;
+    return false;
   }
 
   mCallback->SetSessionId(aCreateSessionToken, &mSessionId[0], mSessionId.length());
 
+  mCallback->ResolvePromise(aPromiseId);
+  return true;
+}
+
+void
+ClearKeySession::Init(uint32_t aCreateSessionToken,
+                      uint32_t aPromiseId,
+                      const std::vector<KeyId>& aKeyIds)
+{
+  CK_LOGD("ClearKeySession::Init with %u cached key IDs", (uint32_t)aKeyIds.size());
+  assert(!aKeyIds.empty() && mKeyIds.empty());
+
+  mKeyIds = aKeyIds;
+
+  mCallback->SetSessionId(aCreateSessionToken, &mSessionId[0], mSessionId.length());
+
   mCallback->ResolvePromise(aPromiseId);
 }
 
@@ -93,3 +118,43 @@ ClearKeySession::AddKeyId(const KeyId& aKeyId)
 {
   mKeyIds.push_back(aKeyId);
 }
+
+KeyStatusBatch::KeyStatusBatch(GMPDecryptorCallback* aCallback,
+                               const std::string& aSessionId)
+  : mCallback(aCallback)
+  , mSessionId(aSessionId)
+{
+}
+
+KeyStatusBatch::~KeyStatusBatch()
+{
+  assert(mChanges.empty());
+}
+
+void
+KeyStatusBatch::Add(const KeyId& aKeyId, GMPMediaKeyStatus aStatus)
+{
+  auto itr = mIndex.find(aKeyId);
+  if (itr != mIndex.end()) {
+    mChanges[itr->second].second = aStatus;
+    return;
+  }
+
+  mIndex[aKeyId] = mChanges.size();
+  mChanges.push_back(std::make_pair(aKeyId, aStatus));
+}
+
+void
+KeyStatusBatch::Flush()
+{
+  CK_LOGD("KeyStatusBatch::Flush %u changes", (uint32_t)mChanges.size());
+
+  for (auto it = mChanges.begin(); it != mChanges.end(); it++) {
+    mCallback->KeyStatusChanged(&mSessionId[0], mSessionId.size(),
+                                &it->first[0], it->first.size(),
+                                it->second);
+  }
+
+  mChanges.clear();
+  mIndex.clear();
+}
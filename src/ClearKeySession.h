@@ -17,6 +17,8 @@
 #ifndef __ClearKeySession_h__
 #define __ClearKeySession_h__
 
+#include <map>
+
 #include "ClearKeyUtils.h"
 #include "gmp-api/gmp-decryption.h"
 
@@ -25,10 +27,38 @@ class GMPDecryptorCallback;
 class GMPDecryptorHost;
 class GMPEncryptedBufferMetadata;
 
+// What a persistent session's stored records hold: a snapshot record in
+// mEpoch, followed by mJournalLength journal entries.
+struct SessionStoreState
+{
+  SessionStoreState()
+    : mEpoch(0)
+    , mJournalLength(0)
+    , mNeedsSnapshot(true)
+    , mStoredExpiration(0)
+    , mWriteInFlight(0)
+  {}
+
+  uint32_t mEpoch;
+  uint32_t mJournalLength;
+  // Set until the session's snapshot record has been written, and once a
+  // write to its records has failed, since the journal may then have a gap.
+  bool mNeedsSnapshot;
+  // The keys and expiration in the records, so that only keys which have
+  // been added or changed since need journalling.
+  std::map<KeyId, Key> mStoredKeys;
+  GMPTimestamp mStoredExpiration;
+  // Identifies the write to the records in flight, if any. Writes are made
+  // one at a time, so that none lands unless those before it have.
+  uint32_t mWriteInFlight;
+  // UpdateSession() promises waiting for the next write.
+  std::vector<uint32_t> mWaitingPromises;
+};
+
 class ClearKeySession
 {
 public:
-  explicit ClearKeySession(const std::string& aSessionId,
+  explicit ClearKeySession(uint32_t aSessionId,
                            GMPDecryptorCallback* aCallback,
                            GMPSessionType aSessionType);
 
@@ -36,23 +66,80 @@ public:
 
   const std::vector<KeyId>& GetKeyIds() const { return mKeyIds; }
 
-  void Init(uint32_t aCreateSessionToken,
+  // Parses the session's key IDs out of the init data, and resolves the
+  // create session promise. Returns false, having rejected the promise, if
+  // the init data doesn't hold any usable key IDs.
+  bool Init(uint32_t aCreateSessionToken,
             uint32_t aPromiseId,
-            const string& aInitDataType,
+            const std::string& aInitDataType,
             const uint8_t* aInitData, uint32_t aInitDataSize);
 
+  // As above, for init data whose key IDs have already been parsed.
+  void Init(uint32_t aCreateSessionToken,
+            uint32_t aPromiseId,
+            const std::vector<KeyId>& aKeyIds);
+
   GMPSessionType Type() const;
 
   void AddKeyId(const KeyId& aKeyId);
 
   const std::string& Id() const { return mSessionId; }
+  uint32_t NumericId() const { return mNumericId; }
+
+  SessionStoreState& StoreState() { return mStoreState; }
+  const SessionStoreState& StoreState() const { return mStoreState; }
+
+  // Set while the session's keys have been evicted from the
+  // ClearKeyDecryptionManager, to be reloaded from its stored records when a
+  // sample needs one. Evicted sessions don't hold their key IDs.
+  bool IsEvicted() const { return mEvicted; }
+  void SetEvicted(bool aEvicted) { mEvicted = aEvicted; }
+
+  // When the session's license expires, in milliseconds since the Unix
+  // epoch, or 0 if it doesn't. Once it has, the session is marked expired
+  // and, like an evicted session, doesn't hold its key IDs.
+  GMPTimestamp Expiration() const { return mExpiration; }
+  void SetExpiration(GMPTimestamp aExpiration) { mExpiration = aExpiration; }
+  bool IsExpired() const { return mExpired; }
+  void SetExpired(bool aExpired) { mExpired = aExpired; }
 
 private:
+  const uint32_t mNumericId;
   const std::string mSessionId;
   std::vector<KeyId> mKeyIds;
+  SessionStoreState mStoreState;
+  bool mEvicted;
+  GMPTimestamp mExpiration;
+  bool mExpired;
 
   GMPDecryptorCallback* mCallback;
   const GMPSessionType mSessionType;
 };
 
+// Collects the key status changes made by one operation on a session, so
+// they can be reported to the host together once the operation is done. A
+// key whose status changes more than once is only reported with its last
+// status. eme-decrypt-v7 has no batched notification, so Flush() makes one
+// KeyStatusChanged() call per key, back to back.
+class KeyStatusBatch
+{
+public:
+  KeyStatusBatch(GMPDecryptorCallback* aCallback, const std::string& aSessionId);
+  ~KeyStatusBatch();
+
+  void Add(const KeyId& aKeyId, GMPMediaKeyStatus aStatus);
+
+  // Reports the collected status changes to the host. Must be called before
+  // the operation's promise is settled.
+  void Flush();
+
+private:
+  GMPDecryptorCallback* mCallback;
+  const std::string& mSessionId;
+
+  std::vector<std::pair<KeyId, GMPMediaKeyStatus>> mChanges;
+  // Index of each key ID's entry in mChanges.
+  std::map<KeyId, size_t> mIndex;
+};
+
 #endif // __ClearKeySession_h__
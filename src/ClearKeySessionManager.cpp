@@ -18,7 +18,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "ClearKeyAsyncShutdown.h"
 #include "ClearKeyDecryptionManager.h"
+#include "ClearKeyRecord.h"
 #include "ClearKeySessionManager.h"
 #include "ClearKeyUtils.h"
 #include "ClearKeyStorage.h"
@@ -33,12 +35,35 @@
 
 using namespace std;
 
+static GMPTimestamp
+CurrentTime()
+{
+  GMPTimestamp now = 0;
+  GetPlatform()->getcurrenttime(&now);
+  return now;
+}
+
 ClearKeySessionManager::ClearKeySessionManager()
   : mDecryptionManager(ClearKeyDecryptionManager::Get())
+  , mCallback(nullptr)
+  , mDecryptMutex(GMPCreateMutex())
+  , mPriorityStreak(0)
+  , mHeldDecryptBytes(0)
+  , mNumQueuedDecrypts(0)
+  , mQueuedDecryptBytes(0)
+  , mNumRejectedDecrypts(0)
+  , mNumStoreWrites(0)
+  , mDecryptSerial(0)
+  , mExpiryWheel(CurrentTime())
+  , mExpiryTimerDeadline(0)
 {
   CK_LOGD("ClearKeySessionManager ctor %p", this);
   AddRef();
 
+  // Unblocked once we've torn down the decrypt thread after
+  // DecryptingComplete().
+  ClearKeyAsyncShutdown::BlockShutdown();
+
   if (GetPlatform()->createthread(&mThread) != GMPNoErr) {
     CK_LOGD("failed to create thread in clearkey cdm");
     mThread = nullptr;
@@ -48,6 +73,9 @@ ClearKeySessionManager::ClearKeySessionManager()
 ClearKeySessionManager::~ClearKeySessionManager()
 {
   CK_LOGD("ClearKeySessionManager dtor %p", this);
+  if (mDecryptMutex) {
+    mDecryptMutex->Destroy();
+  }
 }
 
 static bool
@@ -119,35 +147,53 @@ ClearKeySessionManager::CreateSession(uint32_t aCreateSessionToken,
     return;
   }
 
-  string sessionId = ClearKeyPersistence::GetNewSessionId(aSessionType);
-  assert(mSessions.find(sessionId) == mSessions.end());
+  uint32_t sessionId = ClearKeyPersistence::GetNewSessionId(aSessionType);
+  assert(!Contains(mSessions, sessionId));
 
   ClearKeySession* session = new ClearKeySession(sessionId, mCallback, aSessionType);
-  session->Init(aCreateSessionToken, aPromiseId, initDataType, aInitData, aInitDataSize);
+
+  // Sessions are often created over and over with the same init data, so
+  // reuse the key IDs and request from last time if we can.
+  const ClearKeyInitDataCache::Entry* cached =
+    mInitDataCache.Lookup(initDataType, aInitData, aInitDataSize, aSessionType);
+  if (cached) {
+    session->Init(aCreateSessionToken, aPromiseId, cached->mKeyIds);
+  } else if (!session->Init(aCreateSessionToken, aPromiseId, initDataType,
+                            aInitData, aInitDataSize)) {
+    delete session;
+    return;
+  }
   mSessions[sessionId] = session;
 
+  if (aSessionType == kGMPPersistentSession) {
+    // Start from an epoch which any journal entries left behind by an
+    // earlier session with this ID, say if removing it was interrupted,
+    // are very unlikely to share.
+    session->StoreState().mEpoch = (uint32_t)CurrentTime();
+    TrackKeyUsage(session);
+  }
+
+  // Need to request all the session's key IDs from the client. We always send
+  // a key request, whether or not another session has sent a request with the
+  // same key ID. Otherwise a script can end up waiting for another script to
+  // respond to the request (which may not necessarily happen).
   const vector<KeyId>& sessionKeys = session->GetKeyIds();
-  vector<KeyId> neededKeys;
   for (auto it = sessionKeys.begin(); it != sessionKeys.end(); it++) {
-    // Need to request this key ID from the client. We always send a key
-    // request, whether or not another session has sent a request with the same
-    // key ID. Otherwise a script can end up waiting for another script to
-    // respond to the request (which may not necessarily happen).
-    neededKeys.push_back(*it);
     mDecryptionManager->ExpectKeyId(*it);
   }
 
-  if (neededKeys.empty()) {
-    CK_LOGD("No keys needed from client.");
-    return;
+  if (!cached) {
+    string request;
+    ClearKeyUtils::MakeKeyRequest(sessionKeys, request, aSessionType);
+    cached = mInitDataCache.Insert(initDataType, aInitData, aInitDataSize,
+                                   aSessionType, sessionKeys, move(request));
   }
 
   // Send a request for needed key data.
-  string request;
-  ClearKeyUtils::MakeKeyRequest(neededKeys, request, aSessionType);
-  mCallback->SessionMessage(&sessionId[0], sessionId.length(),
+  mCallback->SessionMessage(&session->Id()[0], session->Id().length(),
                             kGMPLicenseRequest,
-                            (uint8_t*)&request[0], request.length());
+                            (const uint8_t*)cached->mRequest.data(),
+                            cached->mRequest.length());
 }
 
 void
@@ -157,7 +203,8 @@ ClearKeySessionManager::LoadSession(uint32_t aPromiseId,
 {
   CK_LOGD("ClearKeySessionManager::LoadSession");
 
-  if (!ClearKeyUtils::IsValidSessionId(aSessionId, aSessionIdLength)) {
+  uint32_t sessionId;
+  if (!ClearKeyUtils::ParseSessionId(aSessionId, aSessionIdLength, sessionId)) {
     mCallback->ResolveLoadSessionPromise(aPromiseId, false);
     return;
   }
@@ -169,27 +216,29 @@ ClearKeySessionManager::LoadSession(uint32_t aPromiseId,
     return;
   }
 
-  string sid(aSessionId, aSessionId + aSessionIdLength);
-  if (!ClearKeyPersistence::IsPersistentSessionId(sid)) {
+  if (!ClearKeyPersistence::IsPersistentSessionId(sessionId)) {
     mCallback->ResolveLoadSessionPromise(aPromiseId, false);
     return;
   }
 
   // Callsback PersistentSessionDataLoaded with results...
-  ClearKeyPersistence::LoadSessionData(this, sid, aPromiseId);
+  ClearKeyPersistence::LoadSessionData(this, sessionId, aPromiseId);
 }
 
 void
 ClearKeySessionManager::PersistentSessionDataLoaded(GMPErr aStatus,
                                                     uint32_t aPromiseId,
-                                                    const string& aSessionId,
-                                                    const uint8_t* aKeyData,
-                                                    uint32_t aKeyDataSize)
+                                                    uint32_t aSessionId,
+                                                    const StoredSession& aStored)
 {
   CK_LOGD("ClearKeySessionManager::PersistentSessionDataLoaded");
+  if (!mCallback) {
+    // DecryptingComplete() was called while the records were being read.
+    return;
+  }
+
   if (GMP_FAILED(aStatus) ||
-      Contains(mSessions, aSessionId) ||
-      (aKeyDataSize % (2 * CLEARKEY_KEY_LEN)) != 0) {
+      Contains(mSessions, aSessionId)) {
     mCallback->ResolveLoadSessionPromise(aPromiseId, false);
     return;
   }
@@ -199,29 +248,169 @@ ClearKeySessionManager::PersistentSessionDataLoaded(GMPErr aStatus,
                                                  kGMPPersistentSession);
   mSessions[aSessionId] = session;
 
-  uint32_t numKeys = aKeyDataSize / (2 * CLEARKEY_KEY_LEN);
-  for (uint32_t i = 0; i < numKeys; i ++) {
-    const uint8_t* base = aKeyData + 2 * CLEARKEY_KEY_LEN * i;
+  SessionStoreState& state = session->StoreState();
+  state.mEpoch = aStored.mEpoch;
+  state.mJournalLength = aStored.mJournalLength;
+  state.mNeedsSnapshot = false;
+  state.mStoredExpiration = aStored.mExpiration;
 
-    KeyId keyId(base, base + CLEARKEY_KEY_LEN);
+  KeyStatusBatch statuses(mCallback, session->Id());
+  for (auto it = aStored.mKeys.begin(); it != aStored.mKeys.end(); it++) {
+    const KeyId& keyId = it->mKeyId;
     assert(keyId.size() == CLEARKEY_KEY_LEN);
 
-    Key key(base + CLEARKEY_KEY_LEN, base + 2 * CLEARKEY_KEY_LEN);
+    const Key& key = it->mKey;
     assert(key.size() == CLEARKEY_KEY_LEN);
 
     session->AddKeyId(keyId);
+    state.mStoredKeys[keyId] = key;
 
     mDecryptionManager->ExpectKeyId(keyId);
     mDecryptionManager->InitKey(keyId, key);
     mKeyIds.insert(key);
-    mCallback->KeyStatusChanged(&aSessionId[0], aSessionId.size(),
-                                &keyId[0], keyId.size(),
-                                kGMPUsable);
+    statuses.Add(keyId, kGMPUsable);
+  }
+  TrackKeyUsage(session);
+
+  // An offline license may have expired since it was stored.
+  vector<KeyId> expiredKeyIds;
+  if (aStored.mExpiration) {
+    SetSessionExpiration(session, aStored.mExpiration);
+    if (aStored.mExpiration <= CurrentTime()) {
+      ExpireSession(session, statuses, expiredKeyIds);
+    }
   }
+  statuses.Flush();
+  mDecryptionManager->ReleaseKeyIds(expiredKeyIds);
 
   mCallback->ResolveLoadSessionPromise(aPromiseId, true);
+
+  EvictIdleSessions();
 }
 
+void
+ClearKeySessionManager::EvictedSessionDataLoaded(GMPErr aStatus,
+                                                 uint32_t aSessionId,
+                                                 const StoredSession& aStored)
+{
+  CK_LOGD("ClearKeySessionManager::EvictedSessionDataLoaded");
+  if (!mCallback) {
+    // DecryptingComplete() has failed the parked work.
+    return;
+  }
+
+  auto restoring = mRestoringSessions.find(aSessionId);
+  if (restoring == mRestoringSessions.end()) {
+    // The session has been closed.
+    return;
+  }
+  ParkedWork work;
+  work.mDecrypts.swap(restoring->second.mDecrypts);
+  work.mUpdates.swap(restoring->second.mUpdates);
+  mRestoringSessions.erase(restoring);
+
+  auto itr = mSessions.find(aSessionId);
+  assert(itr != mSessions.end());
+  ClearKeySession* session = itr->second;
+
+  // A session which expired while being reloaded stays without its keys.
+  bool restored = GMP_SUCCEEDED(aStatus) && session->IsEvicted();
+  if (restored) {
+    SessionStoreState& state = session->StoreState();
+    const vector<KeyId>& keyIds = session->GetKeyIds();
+    for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+      mDecryptionManager->ExpectKeyId(*it);
+    }
+    ForgetEvictedKeyIds(session);
+    for (auto it = aStored.mKeys.begin(); it != aStored.mKeys.end(); it++) {
+      mDecryptionManager->InitKey(it->mKeyId, it->mKey);
+      state.mStoredKeys[it->mKeyId] = it->mKey;
+    }
+    // The session kept its expiration while evicted, and the records hold
+    // the same one.
+    state.mStoredExpiration = aStored.mExpiration;
+    session->SetEvicted(false);
+  } else if (GMP_FAILED(aStatus)) {
+    CK_LOGW("ClearKey CDM failed to reload evicted session %u", aSessionId);
+  }
+
+  // If the keys couldn't be reloaded, the samples fail with GMPNoKeyErr, and
+  // the next sample tries again.
+  for (size_t i = 0; i < work.mDecrypts.size(); i++) {
+    UncountDecrypt(work.mDecrypts[i]);
+    SubmitDecrypt(work.mDecrypts[i]);
+  }
+  AdmitDecryptBacklog();
+
+  for (size_t i = 0; i < work.mUpdates.size() && mCallback; i++) {
+    const ParkedUpdate& update = work.mUpdates[i];
+    if (!session->IsEvicted()) {
+      UpdateSession(update.mPromiseId,
+                    session->Id().data(), session->Id().size(),
+                    update.mResponse.data(), update.mResponse.size());
+    } else {
+      static const char* message = "Couldn't reload session keys";
+      mCallback->RejectPromise(update.mPromiseId, kGMPInvalidStateError,
+                               message, strlen(message));
+    }
+  }
+
+  EvictIdleSessions();
+}
+
+// Installs each key in a license into the decryption manager as soon as it
+// has been parsed, and has the parser skip the rest of the keys once every
+// key the session is expecting has arrived. Remembers which keys it installed, so that they can
+// be taken back if the rest of the license turns out to be malformed.
+class LicenseKeyInstaller : public ClearKeyLicenseParser::KeyHandler
+{
+public:
+  LicenseKeyInstaller(ClearKeyDecryptionManager* aDecryptionManager,
+                      const ClearKeySession* aSession)
+    : mDecryptionManager(aDecryptionManager)
+    , mHasExpiration(false)
+    , mExpiration(0)
+  {
+    const vector<KeyId>& keyIds = aSession->GetKeyIds();
+    for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+      if (!mDecryptionManager->HasKeyForKeyId(*it)) {
+        mMissingKeyIds.insert(*it);
+      }
+    }
+  }
+
+  bool OnKey(const uint8_t* aKeyId, const uint8_t* aKey) override
+  {
+    KeyId keyId(aKeyId, aKeyId + CLEARKEY_KEY_LEN);
+    if (mDecryptionManager->InitKey(keyId, Key(aKey, aKey + CLEARKEY_KEY_LEN))) {
+      mNewKeyIds.push_back(keyId);
+    }
+    mLicenseKeyIds.push_back(keyId);
+
+    return !(mMissingKeyIds.erase(keyId) && mMissingKeyIds.empty());
+  }
+
+  void OnExpiration(GMPTimestamp aExpiration) override
+  {
+    mHasExpiration = true;
+    mExpiration = aExpiration;
+  }
+
+  // Every key ID in the license, and those whose keys it installed.
+  const vector<KeyId>& LicenseKeyIds() const { return mLicenseKeyIds; }
+  const vector<KeyId>& NewKeyIds() const { return mNewKeyIds; }
+  bool HasExpiration() const { return mHasExpiration; }
+  GMPTimestamp Expiration() const { return mExpiration; }
+
+private:
+  ClearKeyDecryptionManager* mDecryptionManager;
+  set<KeyId> mMissingKeyIds;
+  vector<KeyId> mLicenseKeyIds;
+  vector<KeyId> mNewKeyIds;
+  bool mHasExpiration;
+  GMPTimestamp mExpiration;
+};
+
 void
 ClearKeySessionManager::UpdateSession(uint32_t aPromiseId,
                                       const char* aSessionId,
@@ -230,67 +419,491 @@ ClearKeySessionManager::UpdateSession(uint32_t aPromiseId,
                                       uint32_t aResponseSize)
 {
   CK_LOGD("ClearKeySessionManager::UpdateSession");
-  string sessionId(aSessionId, aSessionId + aSessionIdLength);
-
-  auto itr = mSessions.find(sessionId);
-  if (itr == mSessions.end() || !(itr->second)) {
+  ClearKeySession* session = FindSession(aSessionId, aSessionIdLength);
+  if (!session) {
     CK_LOGW("ClearKey CDM couldn't resolve session ID in UpdateSession.");
     mCallback->RejectPromise(aPromiseId, kGMPNotFoundError, nullptr, 0);
     return;
   }
-  ClearKeySession* session = itr->second;
 
-  // Parse the response for any (key ID, key) pairs.
-  vector<KeyIdPair> keyPairs;
-  if (!ClearKeyUtils::ParseJWK(aResponse, aResponseSize, keyPairs, session->Type())) {
+  if (session->IsEvicted()) {
+    // The license may replace keys the session already has, so wait until
+    // they've been reloaded.
+    ParkedUpdate update;
+    update.mPromiseId = aPromiseId;
+    Assign(update.mResponse, aResponse, aResponseSize);
+
+    uint32_t sessionId = session->NumericId();
+    auto restoring = mRestoringSessions.insert(make_pair(sessionId, ParkedWork()));
+    restoring.first->second.mUpdates.push_back(move(update));
+    if (restoring.second) {
+      ClearKeyPersistence::RestoreSessionData(this, sessionId);
+    }
+    return;
+  }
+
+  bool wasExpired = session->IsExpired();
+  if (wasExpired) {
+    // The response may renew the license, so take the key IDs back to be
+    // able to install its keys. If it doesn't, they expire again below.
+    const vector<KeyId>& keyIds = session->GetKeyIds();
+    for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+      mDecryptionManager->ExpectKeyId(*it);
+    }
+    session->SetExpired(false);
+  }
+
+  // Install keys as they're parsed out of the response, rather than once the
+  // whole response has been parsed.
+  LicenseKeyInstaller installer(mDecryptionManager.get(), session);
+  ClearKeyLicenseParser parser(session->Type(), &installer);
+  if (!parser.Append(aResponse, aResponseSize) || !parser.Finish()) {
     CK_LOGW("ClearKey CDM failed to parse JSON Web Key.");
+    // A malformed response mustn't change the session at all, so take back
+    // the keys installed before it went wrong.
+    mDecryptionManager->RemoveKeys(installer.NewKeyIds());
+    if (wasExpired) {
+      mDecryptionManager->ReleaseKeyIds(session->GetKeyIds());
+      session->SetExpired(true);
+    }
     mCallback->RejectPromise(aPromiseId, kGMPInvalidAccessError, nullptr, 0);
     return;
   }
 
-  for (auto it = keyPairs.begin(); it != keyPairs.end(); it++) {
-    mDecryptionManager->InitKey(it->mKeyId, it->mKey);
-    mKeyIds.insert(it->mKeyId);
-    mCallback->KeyStatusChanged(aSessionId, aSessionIdLength,
-                                &it->mKeyId[0], it->mKeyId.size(),
-                                kGMPUsable);
+  if (installer.HasExpiration()) {
+    SetSessionExpiration(session, installer.Expiration());
   }
 
+  KeyStatusBatch statuses(mCallback, session->Id());
+  const vector<KeyId>& keyIds = installer.LicenseKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    mKeyIds.insert(*it);
+    statuses.Add(*it, kGMPUsable);
+  }
+  vector<KeyId> expiredKeyIds;
+  if (session->Expiration() && session->Expiration() <= CurrentTime()) {
+    ExpireSession(session, statuses, expiredKeyIds);
+  }
+  statuses.Flush();
+  mDecryptionManager->ReleaseKeyIds(expiredKeyIds);
+
   if (session->Type() != kGMPPersistentSession) {
     mCallback->ResolvePromise(aPromiseId);
     return;
   }
 
-  // Store the keys on disk. We store a record whose name is the sessionId,
-  // and simply append each keyId followed by its key.
-  vector<uint8_t> keydata;
-  Serialize(session, keydata);
-  GMPTask* resolve = WrapTask(mCallback, &GMPDecryptorCallback::ResolvePromise, aPromiseId);
-  static const char* message = "Couldn't store cenc key init data";
-  GMPTask* reject = WrapTask(mCallback,
-                             &GMPDecryptorCallback::RejectPromise,
-                             aPromiseId,
-                             kGMPInvalidStateError,
-                             message,
-                             strlen(message));
-  StoreData(sessionId, keydata, resolve, reject);
+  StoreSession(session, aPromiseId);
+}
+
+// Writes one of a session's records, then reports to
+// StoreSessionComplete().
+class ClearKeySessionManager::StoreSessionFlow : public SessionRecordFlow {
+public:
+  StoreSessionFlow(ClearKeySessionManager* aManager,
+                   uint32_t aSessionId,
+                   const string& aRecordName,
+                   const vector<uint8_t>& aRecord,
+                   uint32_t aWrite,
+                   const vector<uint32_t>& aPromiseIds)
+    : SessionRecordFlow(aSessionId, aRecordName, aRecord)
+    , mManager(aManager)
+    , mSessionId(aSessionId)
+    , mWrite(aWrite)
+    , mPromiseIds(aPromiseIds)
+  {
+  }
+
+protected:
+  virtual void OnStored(bool aSucceeded) override
+  {
+    mManager->StoreSessionComplete(mSessionId, mWrite, mPromiseIds,
+                                   aSucceeded);
+  }
+
+private:
+  RefPtr<ClearKeySessionManager> mManager;
+  uint32_t mSessionId;
+  uint32_t mWrite;
+  vector<uint32_t> mPromiseIds;
+};
+
+void
+ClearKeySessionManager::StoreSession(ClearKeySession* aSession,
+                                     uint32_t aPromiseId)
+{
+  SessionStoreState& state = aSession->StoreState();
+  state.mWaitingPromises.push_back(aPromiseId);
+
+  // Were we to write now, this write could land while an earlier one
+  // failed, leaving a record which can't be loaded, or a gap in the
+  // journal, and the promise resolved regardless.
+  if (!state.mWriteInFlight) {
+    WriteSessionRecords(aSession);
+  }
 }
 
 void
-ClearKeySessionManager::Serialize(const ClearKeySession* aSession,
-                                  std::vector<uint8_t>& aOutKeyData)
+ClearKeySessionManager::WriteSessionRecords(ClearKeySession* aSession)
 {
-  const std::vector<KeyId>& keyIds = aSession->GetKeyIds();
+  SessionStoreState& state = aSession->StoreState();
+  assert(!state.mWriteInFlight);
+  vector<uint32_t> promiseIds;
+  promiseIds.swap(state.mWaitingPromises);
+
+  // Find the session's keys which have been added or changed since its
+  // records were last written.
+  vector<uint8_t> changedKeyData;
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
   for (size_t i = 0; i < keyIds.size(); i++) {
     const KeyId& keyId = keyIds[i];
     if (!mDecryptionManager->HasKeyForKeyId(keyId)) {
       continue;
     }
     assert(keyId.size() == CLEARKEY_KEY_LEN);
-    aOutKeyData.insert(aOutKeyData.end(), keyId.begin(), keyId.end());
     const Key& key = mDecryptionManager->GetDecryptionKey(keyId);
     assert(key.size() == CLEARKEY_KEY_LEN);
-    aOutKeyData.insert(aOutKeyData.end(), key.begin(), key.end());
+
+    Key& storedKey = state.mStoredKeys[keyId];
+    if (storedKey != key) {
+      storedKey = key;
+      changedKeyData.insert(changedKeyData.end(), keyId.begin(), keyId.end());
+      changedKeyData.insert(changedKeyData.end(), key.begin(), key.end());
+    }
+  }
+
+  if (changedKeyData.empty() &&
+      aSession->Expiration() == state.mStoredExpiration &&
+      !state.mNeedsSnapshot) {
+    // The records already hold all of the session's keys, and its
+    // expiration.
+    for (auto it = promiseIds.begin(); it != promiseIds.end(); it++) {
+      mCallback->ResolvePromise(*it);
+    }
+    return;
+  }
+
+  state.mWriteInFlight = ++mNumStoreWrites;
+
+  vector<uint8_t> record;
+  if (state.mNeedsSnapshot ||
+      state.mJournalLength >= CLEARKEY_MAX_JOURNAL_ENTRIES) {
+    // Compact the journal into a new snapshot. Moving to a new epoch makes
+    // the old journal entries stale, so they needn't be deleted; the new
+    // journal's entries overwrite them.
+    vector<uint8_t> keyData;
+    for (auto it = state.mStoredKeys.begin(); it != state.mStoredKeys.end(); it++) {
+      keyData.insert(keyData.end(), it->first.begin(), it->first.end());
+      keyData.insert(keyData.end(), it->second.begin(), it->second.end());
+    }
+    state.mEpoch++;
+    state.mJournalLength = 0;
+    state.mNeedsSnapshot = false;
+    state.mStoredExpiration = aSession->Expiration();
+    EncodeSessionRecord(keyData, state.mEpoch, state.mStoredExpiration,
+                        record);
+    (new StoreSessionFlow(this, aSession->NumericId(), aSession->Id(),
+                          record, state.mWriteInFlight, promiseIds))->Start();
+    return;
+  }
+
+  state.mJournalLength++;
+  state.mStoredExpiration = aSession->Expiration();
+  EncodeJournalEntry(changedKeyData, state.mEpoch, state.mStoredExpiration,
+                     record);
+  (new StoreSessionFlow(this, aSession->NumericId(),
+                        ClearKeyPersistence::JournalRecordName(
+                          aSession->NumericId(), state.mJournalLength),
+                        record, state.mWriteInFlight, promiseIds))->Start();
+}
+
+void
+ClearKeySessionManager::StoreSessionComplete(uint32_t aSessionId,
+                                             uint32_t aWrite,
+                                             const vector<uint32_t>& aPromiseIds,
+                                             bool aSucceeded)
+{
+  // The session may have been closed, and even loaded again, meanwhile.
+  ClearKeySession* session = nullptr;
+  auto itr = mSessions.find(aSessionId);
+  if (itr != mSessions.end() &&
+      itr->second->StoreState().mWriteInFlight == aWrite) {
+    session = itr->second;
+    SessionStoreState& state = session->StoreState();
+    state.mWriteInFlight = 0;
+    if (!aSucceeded) {
+      // We don't know what the records hold now; start afresh next time.
+      state.mNeedsSnapshot = true;
+    }
+  }
+
+  if (!mCallback) {
+    return;
+  }
+
+  static const char* message = "Couldn't store cenc key init data";
+  for (auto it = aPromiseIds.begin(); it != aPromiseIds.end(); it++) {
+    if (aSucceeded) {
+      mCallback->ResolvePromise(*it);
+    } else {
+      mCallback->RejectPromise(*it, kGMPInvalidStateError,
+                               message, strlen(message));
+    }
+  }
+
+  if (session && !session->StoreState().mWaitingPromises.empty()) {
+    // After a failure, this is a new snapshot, which also holds the keys
+    // the failed write was for.
+    WriteSessionRecords(session);
+    return;
+  }
+
+  if (aSucceeded) {
+    // The session may only now be evictable.
+    EvictIdleSessions();
+  }
+}
+
+void
+ClearKeySessionManager::SetSessionExpiration(ClearKeySession* aSession,
+                                             GMPTimestamp aExpiration)
+{
+  aSession->SetExpiration(aExpiration);
+  mCallback->ExpirationChanged(aSession->Id().data(), aSession->Id().size(),
+                               aExpiration);
+
+  if (!aExpiration) {
+    mExpiryWheel.Cancel(aSession->NumericId());
+    return;
+  }
+  mExpiryWheel.Schedule(aSession->NumericId(), aExpiration);
+  ScheduleExpiryTimer();
+}
+
+void
+ClearKeySessionManager::ExpireSession(ClearKeySession* aSession,
+                                      KeyStatusBatch& aStatuses,
+                                      vector<KeyId>& aOutKeyIds)
+{
+  uint32_t sessionId = aSession->NumericId();
+  CK_LOGD("ClearKeySessionManager expiring session %u", sessionId);
+  assert(!aSession->IsExpired());
+
+  mExpiryWheel.Cancel(sessionId);
+
+  // An evicted session has already released its key IDs, and mustn't have
+  // its keys reloaded now.
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    if (!aSession->IsEvicted()) {
+      aOutKeyIds.push_back(*it);
+    }
+    aStatuses.Add(*it, kGMPExpired);
+  }
+  if (aSession->IsEvicted()) {
+    ForgetEvictedKeyIds(aSession);
+  }
+
+  aSession->SetEvicted(false);
+  aSession->SetExpired(true);
+}
+
+void
+ClearKeySessionManager::ExpireSessions()
+{
+  vector<uint32_t> expired;
+  mExpiryWheel.Advance(CurrentTime(), expired);
+
+  // Release the key IDs of every session expiring now together, so the
+  // decrypt thread sees them all go at once.
+  vector<KeyId> keyIds;
+  for (size_t i = 0; i < expired.size(); i++) {
+    auto itr = mSessions.find(expired[i]);
+    if (itr == mSessions.end() || itr->second->IsExpired()) {
+      continue;
+    }
+    KeyStatusBatch statuses(mCallback, itr->second->Id());
+    ExpireSession(itr->second, statuses, keyIds);
+    statuses.Flush();
+  }
+  mDecryptionManager->ReleaseKeyIds(keyIds);
+
+  ScheduleExpiryTimer();
+}
+
+void
+ClearKeySessionManager::ScheduleExpiryTimer()
+{
+  GMPTimestamp deadline;
+  if (!mExpiryWheel.NextDeadline(deadline) ||
+      (mExpiryTimerDeadline && mExpiryTimerDeadline <= deadline)) {
+    return;
+  }
+
+  GMPTimestamp now = CurrentTime();
+  int64_t delay = deadline > now ? deadline - now : 0;
+  GMPTask* task = WrapTaskRefCounted(this,
+                                     &ClearKeySessionManager::ExpiryTimerFired,
+                                     deadline);
+  if (GMP_FAILED(GetPlatform()->settimer(task, delay))) {
+    CK_LOGE("ClearKey CDM failed to set session expiry timer");
+    task->Destroy();
+    return;
+  }
+  mExpiryTimerDeadline = deadline;
+}
+
+void
+ClearKeySessionManager::ExpiryTimerFired(GMPTimestamp aDeadline)
+{
+  if (!mCallback) {
+    // DecryptingComplete() has been called.
+    return;
+  }
+
+  if (aDeadline == mExpiryTimerDeadline) {
+    mExpiryTimerDeadline = 0;
+  }
+  ExpireSessions();
+}
+
+bool
+ClearKeySessionManager::IsEvictable(const ClearKeySession* aSession) const
+{
+  if (aSession->Type() != kGMPPersistentSession ||
+      aSession->IsEvicted() ||
+      aSession->IsExpired()) {
+    return false;
+  }
+
+  // Its records must hold all of its keys and its expiration, and be sure to
+  // stay that way.
+  const SessionStoreState& state = aSession->StoreState();
+  if (state.mNeedsSnapshot ||
+      state.mWriteInFlight ||
+      state.mStoredExpiration != aSession->Expiration()) {
+    return false;
+  }
+
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    // Samples using its keys may be in flight.
+    if (Contains(mDecryptStreams, *it) ||
+        !mDecryptionManager->HasKeyForKeyId(*it)) {
+      return false;
+    }
+    auto stored = state.mStoredKeys.find(*it);
+    if (stored == state.mStoredKeys.end() ||
+        stored->second != mDecryptionManager->GetDecryptionKey(*it)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+ClearKeySessionManager::EvictSession(ClearKeySession* aSession)
+{
+  CK_LOGD("ClearKeySessionManager evicting session %u", aSession->NumericId());
+  assert(IsEvictable(aSession));
+
+  // Key IDs other sessions expect too keep their decryptors.
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    mDecryptionManager->ReleaseKeyId(*it);
+    mEvictedKeyIds[*it].insert(aSession->NumericId());
+  }
+
+  // The records are the only copy of the keys now.
+  aSession->StoreState().mStoredKeys.clear();
+  aSession->SetEvicted(true);
+}
+
+void
+ClearKeySessionManager::TrackKeyUsage(const ClearKeySession* aSession)
+{
+  if (!CLEARKEY_MAX_RESIDENT_SESSIONS ||
+      aSession->Type() != kGMPPersistentSession) {
+    return;
+  }
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    mKeyUsage[*it].mNumSessions++;
+  }
+}
+
+void
+ClearKeySessionManager::UntrackKeyUsage(const ClearKeySession* aSession)
+{
+  if (!CLEARKEY_MAX_RESIDENT_SESSIONS ||
+      aSession->Type() != kGMPPersistentSession) {
+    return;
+  }
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    auto usage = mKeyUsage.find(*it);
+    assert(usage != mKeyUsage.end() && usage->second.mNumSessions > 0);
+    if (!--usage->second.mNumSessions) {
+      mKeyUsage.erase(usage);
+    }
+  }
+}
+
+void
+ClearKeySessionManager::ForgetEvictedKeyIds(const ClearKeySession* aSession)
+{
+  const vector<KeyId>& keyIds = aSession->GetKeyIds();
+  for (auto it = keyIds.begin(); it != keyIds.end(); it++) {
+    auto evicted = mEvictedKeyIds.find(*it);
+    if (evicted == mEvictedKeyIds.end()) {
+      continue;
+    }
+    evicted->second.erase(aSession->NumericId());
+    if (evicted->second.empty()) {
+      mEvictedKeyIds.erase(evicted);
+    }
+  }
+}
+
+void
+ClearKeySessionManager::EvictIdleSessions()
+{
+  if (!CLEARKEY_MAX_RESIDENT_SESSIONS) {
+    return;
+  }
+
+  for (;;) {
+    uint32_t numResident = 0;
+    ClearKeySession* idlest = nullptr;
+    uint64_t idlestLastUsed = 0;
+    for (auto it = mSessions.begin(); it != mSessions.end(); it++) {
+      ClearKeySession* session = it->second;
+      if (session->Type() != kGMPPersistentSession || session->IsEvicted()) {
+        continue;
+      }
+      numResident++;
+      if (!IsEvictable(session)) {
+        continue;
+      }
+
+      uint64_t lastUsed = 0;
+      const vector<KeyId>& keyIds = session->GetKeyIds();
+      for (auto k = keyIds.begin(); k != keyIds.end(); k++) {
+        auto usage = mKeyUsage.find(*k);
+        if (usage != mKeyUsage.end() && usage->second.mLastUsed > lastUsed) {
+          lastUsed = usage->second.mLastUsed;
+        }
+      }
+      if (!idlest || lastUsed < idlestLastUsed) {
+        idlest = session;
+        idlestLastUsed = lastUsed;
+      }
+    }
+
+    if (numResident <= CLEARKEY_MAX_RESIDENT_SESSIONS || !idlest) {
+      return;
+    }
+    EvictSession(idlest);
   }
 }
 
@@ -301,46 +914,95 @@ ClearKeySessionManager::CloseSession(uint32_t aPromiseId,
 {
   CK_LOGD("ClearKeySessionManager::CloseSession");
 
-  string sessionId(aSessionId, aSessionId + aSessionIdLength);
-  auto itr = mSessions.find(sessionId);
-  if (itr == mSessions.end()) {
+  ClearKeySession* session = FindSession(aSessionId, aSessionIdLength);
+  if (!session) {
     CK_LOGW("ClearKey CDM couldn't close non-existent session.");
     mCallback->RejectPromise(aPromiseId, kGMPNotFoundError, nullptr, 0);
     return;
   }
 
-  ClearKeySession* session = itr->second;
-  assert(session);
-
   ClearInMemorySessionData(session);
   mCallback->ResolvePromise(aPromiseId);
   mCallback->SessionClosed(aSessionId, aSessionIdLength);
 }
 
+ClearKeySession*
+ClearKeySessionManager::FindSession(const char* aSessionId,
+                                    uint32_t aSessionIdLength) const
+{
+  uint32_t sessionId;
+  if (!ClearKeyUtils::ParseSessionId(aSessionId, aSessionIdLength, sessionId)) {
+    return nullptr;
+  }
+
+  auto itr = mSessions.find(sessionId);
+  return itr != mSessions.end() ? itr->second : nullptr;
+}
+
 void
 ClearKeySessionManager::ClearInMemorySessionData(ClearKeySession* aSession)
 {
-  mSessions.erase(aSession->Id());
+  uint32_t sessionId = aSession->NumericId();
+  mSessions.erase(sessionId);
+  mExpiryWheel.Cancel(sessionId);
+
+  UntrackKeyUsage(aSession);
+  ForgetEvictedKeyIds(aSession);
+
+  auto restoring = mRestoringSessions.find(sessionId);
+  if (restoring != mRestoringSessions.end()) {
+    ParkedWork work;
+    work.mDecrypts.swap(restoring->second.mDecrypts);
+    work.mUpdates.swap(restoring->second.mUpdates);
+    mRestoringSessions.erase(restoring);
+
+    // Another evicted session may have the samples' key ID; if not, they
+    // fail with GMPNoKeyErr.
+    for (size_t i = 0; i < work.mDecrypts.size(); i++) {
+      UncountDecrypt(work.mDecrypts[i]);
+      AdmitDecrypt(work.mDecrypts[i]);
+    }
+    for (size_t i = 0; i < work.mUpdates.size(); i++) {
+      mCallback->RejectPromise(work.mUpdates[i].mPromiseId, kGMPNotFoundError,
+                               nullptr, 0);
+    }
+    AdmitDecryptBacklog();
+  }
+
+  // Updates waiting for a write in flight will never be written now.
+  const vector<uint32_t>& waiting = aSession->StoreState().mWaitingPromises;
+  for (auto it = waiting.begin(); it != waiting.end(); it++) {
+    static const char* message = "Session closed before its keys were stored";
+    mCallback->RejectPromise(*it, kGMPInvalidStateError,
+                             message, strlen(message));
+  }
+
   delete aSession;
 }
 
+static void
+JournalEntryDeleted(bool aSucceeded)
+{
+  if (!aSucceeded) {
+    CK_LOGW("ClearKey CDM failed to delete journal entry");
+  }
+}
+
 void
 ClearKeySessionManager::RemoveSession(uint32_t aPromiseId,
                                       const char* aSessionId,
                                       uint32_t aSessionIdLength)
 {
   CK_LOGD("ClearKeySessionManager::RemoveSession");
-  string sessionId(aSessionId, aSessionId + aSessionIdLength);
-  auto itr = mSessions.find(sessionId);
-  if (itr == mSessions.end()) {
+  ClearKeySession* session = FindSession(aSessionId, aSessionIdLength);
+  if (!session) {
     CK_LOGW("ClearKey CDM couldn't remove non-existent session.");
     mCallback->RejectPromise(aPromiseId, kGMPNotFoundError, nullptr, 0);
     return;
   }
 
-  ClearKeySession* session = itr->second;
-  assert(session);
-  string sid = session->Id();
+  string sessionId = session->Id();
+  uint32_t sid = session->NumericId();
   bool isPersistent = session->Type() == kGMPPersistentSession;
   ClearInMemorySessionData(session);
 
@@ -351,9 +1013,18 @@ ClearKeySessionManager::RemoveSession(uint32_t aPromiseId,
 
   ClearKeyPersistence::PersistentSessionRemoved(sid);
 
-  // Overwrite the record storing the sessionId's key data with a zero
-  // length record to delete it.
+  // Overwrite the records storing the sessionId's key data with zero
+  // length records to delete them. Stale journal entries from earlier
+  // epochs may lie beyond the current journal's end, so delete them all.
   vector<uint8_t> emptyKeydata;
+  for (uint32_t i = 1; i <= CLEARKEY_MAX_JOURNAL_ENTRIES; i++) {
+    StoreData(ClearKeyPersistence::JournalRecordName(sid, i), emptyKeydata,
+              WrapTaskNM(&JournalEntryDeleted, true),
+              WrapTaskNM(&JournalEntryDeleted, false));
+  }
+
+  // Without its snapshot record, the session's journal entries can't be
+  // loaded, so only this deletion settles the promise.
   GMPTask* resolve = WrapTask(mCallback, &GMPDecryptorCallback::ResolvePromise, aPromiseId);
   static const char* message = "Could not remove session";
   GMPTask* reject = WrapTask(mCallback,
@@ -382,27 +1053,250 @@ ClearKeySessionManager::Decrypt(GMPBuffer* aBuffer,
 {
   CK_LOGD("ClearKeySessionManager::Decrypt");
 
+  DecryptRequest* request = new DecryptRequest(aBuffer, aMetadata);
+
+  if (CLEARKEY_MAX_RESIDENT_SESSIONS) {
+    auto usage = mKeyUsage.find(request->mMetadata.mKeyId);
+    if (usage != mKeyUsage.end()) {
+      usage->second.mLastUsed = ++mDecryptSerial;
+    }
+  }
+
+  if (!mDecryptBacklog.empty() || !CanQueueDecrypt(aBuffer->Size())) {
+    if (!CanHoldDecrypt(aBuffer->Size())) {
+      CK_LOGW("Decrypt backlog full (%u samples, %u bytes); rejecting sample",
+              (uint32_t)mDecryptBacklog.size(), (uint32_t)mHeldDecryptBytes);
+      mNumRejectedDecrypts++;
+      delete request;
+      mCallback->Decrypted(aBuffer, GMPQuotaExceededErr);
+      return;
+    }
+    // Hold the sample back until the decrypt thread catches up; the host
+    // won't send much more while it's waiting on it. Later samples wait
+    // behind it, so every stream stays in order.
+    CK_LOGD("Decrypt queue full (%u samples, %u bytes); holding sample",
+            mNumQueuedDecrypts, (uint32_t)mQueuedDecryptBytes);
+    mDecryptBacklog.push_back(request);
+    mHeldDecryptBytes += aBuffer->Size();
+    return;
+  }
+
+  AdmitDecrypt(request);
+}
+
+void
+ClearKeySessionManager::AdmitDecrypt(DecryptRequest* aRequest)
+{
+  if (CLEARKEY_MAX_RESIDENT_SESSIONS) {
+    const KeyId& keyId = aRequest->mMetadata.mKeyId;
+    auto evicted = mEvictedKeyIds.find(keyId);
+    if (evicted != mEvictedKeyIds.end() &&
+        !mDecryptionManager->HasKeyForKeyId(keyId)) {
+      // Hold the sample until the keys of a session with its key ID have
+      // been reloaded. Later samples with the same key ID park behind it, so
+      // stay in order.
+      const set<uint32_t>& sessionIds = evicted->second;
+      assert(!sessionIds.empty());
+      uint32_t sessionId = *sessionIds.begin();
+      for (auto it = sessionIds.begin(); it != sessionIds.end(); it++) {
+        if (Contains(mRestoringSessions, *it)) {
+          sessionId = *it;
+          break;
+        }
+      }
+      CountDecrypt(aRequest);
+      auto restoring = mRestoringSessions.insert(make_pair(sessionId, ParkedWork()));
+      restoring.first->second.mDecrypts.push_back(aRequest);
+      if (restoring.second) {
+        ClearKeyPersistence::RestoreSessionData(this, sessionId);
+      }
+      return;
+    }
+  }
+
+  SubmitDecrypt(aRequest);
+}
+
+void
+ClearKeySessionManager::AdmitDecryptBacklog()
+{
+  while (mCallback &&
+         !mDecryptBacklog.empty() &&
+         CanQueueDecrypt(mDecryptBacklog.front()->mBuffer->Size())) {
+    DecryptRequest* request = mDecryptBacklog.front();
+    mDecryptBacklog.pop_front();
+    mHeldDecryptBytes -= request->mBuffer->Size();
+    AdmitDecrypt(request);
+  }
+}
+
+void
+ClearKeySessionManager::SubmitDecrypt(DecryptRequest* aRequest)
+{
+  GMPBuffer* buffer = aRequest->mBuffer;
+  const KeyId& keyId = aRequest->mMetadata.mKeyId;
+  auto stream = mDecryptStreams.find(keyId);
+
+  // Small samples take less time to decrypt than to hand over to the decrypt
+  // thread, so decrypt them here. We can only do that if every sample we've
+  // already queued with this key ID has been reported, otherwise we'd report
+  // out of order.
+  if (buffer->Size() < CLEARKEY_INLINE_DECRYPT_THRESHOLD &&
+      stream == mDecryptStreams.end()) {
+    GMPErr rv = mDecryptionManager->Decrypt(buffer->Data(), buffer->Size(),
+                                            aRequest->mMetadata);
+    CK_LOGD("Inline decrypt finished with code %x\n", rv);
+    delete aRequest;
+    mCallback->Decrypted(buffer, rv);
+    return;
+  }
+
   if (!mThread) {
     CK_LOGW("No decrypt thread");
-    mCallback->Decrypted(aBuffer, GMPGenericErr);
+    delete aRequest;
+    mCallback->Decrypted(buffer, GMPGenericErr);
     return;
   }
 
-  mThread->Post(WrapTaskRefCounted(this,
-                                   &ClearKeySessionManager::DoDecrypt,
-                                   aBuffer, aMetadata));
+  if (stream == mDecryptStreams.end()) {
+    DecryptLane lane = buffer->Size() <= CLEARKEY_PRIORITY_DECRYPT_THRESHOLD
+                       ? kPriorityLane : kBulkLane;
+    stream = mDecryptStreams.insert(make_pair(keyId, DecryptStream(lane))).first;
+  }
+  stream->second.mNumPending++;
+  aRequest->mLane = stream->second.mLane;
+  QueueDecrypt(aRequest);
+}
+
+bool
+ClearKeySessionManager::CanQueueDecrypt(size_t aSize) const
+{
+  // A sample larger than the byte limit can still be queued on its own.
+  return !mNumQueuedDecrypts ||
+         (mNumQueuedDecrypts < CLEARKEY_MAX_QUEUED_DECRYPTS &&
+          mQueuedDecryptBytes + aSize <= CLEARKEY_MAX_QUEUED_DECRYPT_BYTES);
+}
+
+bool
+ClearKeySessionManager::CanHoldDecrypt(size_t aSize) const
+{
+  return mDecryptBacklog.empty() ||
+         (mDecryptBacklog.size() < CLEARKEY_MAX_HELD_DECRYPTS &&
+          mHeldDecryptBytes + aSize <= CLEARKEY_MAX_HELD_DECRYPT_BYTES);
 }
 
 void
-ClearKeySessionManager::DoDecrypt(GMPBuffer* aBuffer,
-                                  GMPEncryptedBufferMetadata* aMetadata)
+ClearKeySessionManager::CountDecrypt(const DecryptRequest* aRequest)
+{
+  mNumQueuedDecrypts++;
+  mQueuedDecryptBytes += aRequest->mBuffer->Size();
+}
+
+void
+ClearKeySessionManager::UncountDecrypt(const DecryptRequest* aRequest)
+{
+  assert(mNumQueuedDecrypts > 0 &&
+         mQueuedDecryptBytes >= aRequest->mBuffer->Size());
+  mNumQueuedDecrypts--;
+  mQueuedDecryptBytes -= aRequest->mBuffer->Size();
+}
+
+void
+ClearKeySessionManager::QueueDecrypt(DecryptRequest* aRequest)
+{
+  CountDecrypt(aRequest);
+
+  {
+    AutoLock lock(mDecryptMutex);
+    mDecryptLanes[aRequest->mLane].push_back(aRequest);
+  }
+
+  // Each task decrypts whichever queued sample is most urgent when it runs.
+  mThread->Post(WrapTaskRefCounted(this, &ClearKeySessionManager::DoDecrypt));
+}
+
+ClearKeySessionManager::DecryptRequest*
+ClearKeySessionManager::PopDecryptRequest()
+{
+  std::deque<DecryptRequest*>& priority = mDecryptLanes[kPriorityLane];
+  std::deque<DecryptRequest*>& bulk = mDecryptLanes[kBulkLane];
+
+  if (priority.empty() && bulk.empty()) {
+    // Cancelled by DecryptingComplete().
+    return nullptr;
+  }
+
+  std::deque<DecryptRequest*>* lane;
+  if (!priority.empty() &&
+      (bulk.empty() ||
+       mPriorityStreak < CLEARKEY_MAX_PRIORITY_DECRYPT_STREAK)) {
+    lane = &priority;
+    mPriorityStreak++;
+  } else {
+    lane = &bulk;
+    mPriorityStreak = 0;
+  }
+
+  assert(!lane->empty());
+  DecryptRequest* request = lane->front();
+  lane->pop_front();
+  return request;
+}
+
+void
+ClearKeySessionManager::DoDecrypt()
 {
   CK_LOGD("ClearKeySessionManager::DoDecrypt");
 
-  GMPErr rv = mDecryptionManager->Decrypt(aBuffer->Data(), aBuffer->Size(),
-                                          CryptoMetaData(aMetadata));
+  DecryptRequest* request;
+  {
+    AutoLock lock(mDecryptMutex);
+    request = PopDecryptRequest();
+  }
+  if (!request) {
+    return;
+  }
+
+  GMPBuffer* buffer = request->mBuffer;
+  GMPErr rv = mDecryptionManager->Decrypt(buffer->Data(), buffer->Size(),
+                                          request->mMetadata);
   CK_LOGD("DeDecrypt finished with code %x\n", rv);
-  mCallback->Decrypted(aBuffer, rv);
+
+  // Report back on the main thread, so that results from here and from
+  // inline decrypts reach the host in the order the samples arrived.
+  GetPlatform()->runonmainthread(
+    WrapTaskRefCounted(this,
+                       &ClearKeySessionManager::DecryptComplete,
+                       request, rv));
+}
+
+void
+ClearKeySessionManager::DecryptComplete(DecryptRequest* aRequest,
+                                        GMPErr aResult)
+{
+  CK_LOGD("ClearKeySessionManager::DecryptComplete");
+
+  auto stream = mDecryptStreams.find(aRequest->mMetadata.mKeyId);
+  assert(stream != mDecryptStreams.end() && stream->second.mNumPending > 0);
+  if (!--stream->second.mNumPending) {
+    mDecryptStreams.erase(stream);
+  }
+
+  UncountDecrypt(aRequest);
+  GMPBuffer* buffer = aRequest->mBuffer;
+  delete aRequest;
+
+  if (!mCallback) {
+    // DecryptingComplete() has been called, so the host no longer wants
+    // results. It frees a buffer when it's reported, so without a report we
+    // must free it; GMPBuffer's destructor is virtual, so this runs the
+    // host's.
+    delete buffer;
+    return;
+  }
+  mCallback->Decrypted(buffer, aResult);
+
+  AdmitDecryptBacklog();
 }
 
 void
@@ -416,15 +1310,92 @@ ClearKeySessionManager::Shutdown()
   mSessions.clear();
 }
 
+void
+ClearKeySessionManager::CancelQueuedDecrypts()
+{
+  for (auto it = mRestoringSessions.begin(); it != mRestoringSessions.end(); it++) {
+    vector<DecryptRequest*>& parked = it->second.mDecrypts;
+    for (size_t i = 0; i < parked.size(); i++) {
+      UncountDecrypt(parked[i]);
+      GMPBuffer* buffer = parked[i]->mBuffer;
+      delete parked[i];
+      mCallback->Decrypted(buffer, GMPAbortedErr);
+    }
+  }
+  mRestoringSessions.clear();
+
+  // Taken first, so that cancelling the queue below doesn't move them into
+  // it. They arrived after everything queued, so are reported after it.
+  std::deque<DecryptRequest*> backlog;
+  backlog.swap(mDecryptBacklog);
+  mHeldDecryptBytes = 0;
+
+  std::deque<DecryptRequest*> cancelled;
+  {
+    AutoLock lock(mDecryptMutex);
+    for (size_t i = 0; i < kNumDecryptLanes; i++) {
+      cancelled.insert(cancelled.end(),
+                       mDecryptLanes[i].begin(), mDecryptLanes[i].end());
+      mDecryptLanes[i].clear();
+    }
+  }
+
+  CK_LOGD("ClearKeySessionManager cancelling %u queued and %u held decrypts",
+          (uint32_t)cancelled.size(), (uint32_t)backlog.size());
+  for (auto it = cancelled.begin(); it != cancelled.end(); it++) {
+    DecryptComplete(*it, GMPAbortedErr);
+  }
+
+  for (auto it = backlog.begin(); it != backlog.end(); it++) {
+    GMPBuffer* buffer = (*it)->mBuffer;
+    delete *it;
+    mCallback->Decrypted(buffer, GMPAbortedErr);
+  }
+}
+
+void
+ClearKeySessionManager::DecryptThreadIdle()
+{
+  // Runs on the decrypt thread after every task posted before
+  // DecryptingComplete(). We can't join a thread from itself, so bounce
+  // back to the main thread to do it.
+  GetPlatform()->runonmainthread(
+    WrapTaskRefCounted(this, &ClearKeySessionManager::JoinDecryptThread));
+}
+
+void
+ClearKeySessionManager::JoinDecryptThread()
+{
+  CK_LOGD("ClearKeySessionManager::JoinDecryptThread %p", this);
+  if (mThread) {
+    // The thread has run its last task, so this won't block for long.
+    mThread->Join();
+    mThread = nullptr;
+  }
+  mDecryptionManager = nullptr;
+  ClearKeyAsyncShutdown::UnblockShutdown();
+}
+
 void
 ClearKeySessionManager::DecryptingComplete()
 {
   CK_LOGD("ClearKeySessionManager::DecryptingComplete %p", this);
 
-  GMPThread* thread = mThread;
-  thread->Join();
+  // Fail anything still waiting for the decrypt thread rather than
+  // blocking the main thread until it's all been decrypted. At most one
+  // sample is being decrypted now; its result is dropped, and its buffer
+  // freed, when it completes.
+  CancelQueuedDecrypts();
 
   Shutdown();
-  mDecryptionManager = nullptr;
+  mCallback = nullptr;
+
+  if (mThread) {
+    mThread->Post(WrapTaskRefCounted(this,
+                                     &ClearKeySessionManager::DecryptThreadIdle));
+  } else {
+    JoinDecryptThread();
+  }
+
   Release();
 }
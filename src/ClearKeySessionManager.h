@@ -17,17 +17,75 @@
 #ifndef __ClearKeyDecryptor_h__
 #define __ClearKeyDecryptor_h__
 
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "ClearKeyDecryptionManager.h"
+#include "ClearKeyInitDataCache.h"
+#include "ClearKeyPersistence.h"
 #include "ClearKeySession.h"
+#include "ClearKeyTimerWheel.h"
 #include "ClearKeyUtils.h"
 #include "gmp-api/gmp-decryption.h"
 #include "RefCounted.h"
 
+// Samples smaller than this many bytes are decrypted synchronously on the
+// calling thread when no other samples with their key ID are pending, rather
+// than paying for a round trip through the decrypt thread. Set to 0 to
+// always decrypt on the decrypt thread.
+#ifndef CLEARKEY_INLINE_DECRYPT_THRESHOLD
+#define CLEARKEY_INLINE_DECRYPT_THRESHOLD 4096
+#endif
+
+// Samples no larger than this many bytes are queued in the priority decrypt
+// lane, which is serviced ahead of the bulk lane, unless samples with their
+// key ID are already queued in the bulk lane. Audio samples are well under
+// this, most video frames aren't.
+#ifndef CLEARKEY_PRIORITY_DECRYPT_THRESHOLD
+#define CLEARKEY_PRIORITY_DECRYPT_THRESHOLD 8192
+#endif
+
+// Maximum number of priority lane samples decrypted in a row while the bulk
+// lane is waiting, so that bulk samples always make progress.
+#ifndef CLEARKEY_MAX_PRIORITY_DECRYPT_STREAK
+#define CLEARKEY_MAX_PRIORITY_DECRYPT_STREAK 8
+#endif
+
+// Limits on the samples queued for the decrypt thread, or waiting for an
+// evicted session's keys to be reloaded. Samples which would exceed either
+// limit wait on the main thread, unacknowledged, until the decrypt thread
+// catches up. The host waits for each sample's result before decoding it, so
+// holding them back slows it down rather than failing playback.
+#ifndef CLEARKEY_MAX_QUEUED_DECRYPTS
+#define CLEARKEY_MAX_QUEUED_DECRYPTS 512
+#endif
+#ifndef CLEARKEY_MAX_QUEUED_DECRYPT_BYTES
+#define CLEARKEY_MAX_QUEUED_DECRYPT_BYTES (32 * 1024 * 1024)
+#endif
+
+// Limits on the samples held back on the main thread. A host waiting on
+// their results shouldn't reach these; samples which would exceed either
+// limit anyway are failed straight away with GMPQuotaExceededErr, so that
+// memory stays bounded whatever the host does.
+#ifndef CLEARKEY_MAX_HELD_DECRYPTS
+#define CLEARKEY_MAX_HELD_DECRYPTS 512
+#endif
+#ifndef CLEARKEY_MAX_HELD_DECRYPT_BYTES
+#define CLEARKEY_MAX_HELD_DECRYPT_BYTES (32 * 1024 * 1024)
+#endif
+
+// If non-zero, at most this many persistent sessions keep their keys in
+// memory. Beyond that, the keys of the persistent sessions whose keys were
+// least recently used to decrypt are evicted, once they're safely in the
+// sessions' stored records, and reloaded when a sample needs one of them.
+#ifndef CLEARKEY_MAX_RESIDENT_SESSIONS
+#define CLEARKEY_MAX_RESIDENT_SESSIONS 0
+#endif
+
 class ClearKeySessionManager final : public GMPDecryptor
                                    , public RefCounted
 {
@@ -71,28 +129,191 @@ public:
 
   virtual void DecryptingComplete() override;
 
+  // Samples queued for or awaiting report from the decrypt thread, or
+  // waiting for an evicted session's keys. Main thread only.
+  uint32_t NumQueuedDecrypts() const { return mNumQueuedDecrypts; }
+  size_t QueuedDecryptBytes() const { return mQueuedDecryptBytes; }
+  // Samples held back until there's room for them in the decrypt queue.
+  uint32_t NumHeldDecrypts() const { return mDecryptBacklog.size(); }
+  size_t HeldDecryptBytes() const { return mHeldDecryptBytes; }
+  // Samples failed because too many were already held back.
+  uint32_t NumRejectedDecrypts() const { return mNumRejectedDecrypts; }
+
   void PersistentSessionDataLoaded(GMPErr aStatus,
                                    uint32_t aPromiseId,
-                                   const std::string& aSessionId,
-                                   const uint8_t* aKeyData,
-                                   uint32_t aKeyDataSize);
+                                   uint32_t aSessionId,
+                                   const StoredSession& aStored);
+
+  // Reinstalls an evicted session's keys, and retries the samples waiting
+  // on them.
+  void EvictedSessionDataLoaded(GMPErr aStatus,
+                                uint32_t aSessionId,
+                                const StoredSession& aStored);
 
 private:
   ~ClearKeySessionManager();
 
-  void DoDecrypt(GMPBuffer* aBuffer, GMPEncryptedBufferMetadata* aMetadata);
+  enum DecryptLane {
+    kPriorityLane,
+    kBulkLane,
+    kNumDecryptLanes
+  };
+
+  struct DecryptRequest {
+    DecryptRequest(GMPBuffer* aBuffer,
+                   GMPEncryptedBufferMetadata* aMetadata)
+      : mBuffer(aBuffer)
+      , mMetadata(aMetadata)
+      , mLane(kBulkLane)
+    {}
+    GMPBuffer* mBuffer;
+    CryptoMetaData mMetadata;
+    // Set when the sample is queued for mThread.
+    DecryptLane mLane;
+  };
+
+  // Samples with the same key ID may belong to the same track, so are
+  // reported in the order they arrived. While any are queued or awaiting
+  // report, later ones join them in their lane whatever their size, as the
+  // lanes don't keep order between them. So small samples only overtake
+  // large ones queued before them when their key IDs differ, which they
+  // usually do for audio and video; a track sharing its key ID with one
+  // falling behind waits for it.
+  struct DecryptStream {
+    explicit DecryptStream(DecryptLane aLane)
+      : mLane(aLane)
+      , mNumPending(0)
+    {}
+    DecryptLane mLane;
+    uint32_t mNumPending;
+  };
+
+  // Samples and UpdateSession() calls waiting for an evicted session's keys
+  // to be reloaded.
+  struct ParkedUpdate {
+    uint32_t mPromiseId;
+    std::vector<uint8_t> mResponse;
+  };
+  struct ParkedWork {
+    std::vector<DecryptRequest*> mDecrypts;
+    std::vector<ParkedUpdate> mUpdates;
+  };
+
+  void AdmitDecrypt(DecryptRequest* aRequest);
+  void AdmitDecryptBacklog();
+  void SubmitDecrypt(DecryptRequest* aRequest);
+  bool CanQueueDecrypt(size_t aSize) const;
+  bool CanHoldDecrypt(size_t aSize) const;
+  void QueueDecrypt(DecryptRequest* aRequest);
+  void CountDecrypt(const DecryptRequest* aRequest);
+  void UncountDecrypt(const DecryptRequest* aRequest);
+  void DoDecrypt();
+  DecryptRequest* PopDecryptRequest();
+  void CancelQueuedDecrypts();
+  void DecryptThreadIdle();
+  void JoinDecryptThread();
+  void DecryptComplete(DecryptRequest* aRequest, GMPErr aResult);
   void Shutdown();
 
+  ClearKeySession* FindSession(const char* aSessionId,
+                               uint32_t aSessionIdLength) const;
   void ClearInMemorySessionData(ClearKeySession* aSession);
-  void Serialize(const ClearKeySession* aSession, std::vector<uint8_t>& aOutKeyData);
+
+  // Writes a persistent session's added or changed keys to its journal,
+  // or compacts the journal into a new snapshot record, then settles
+  // aPromiseId. While another write to its records is in flight, waits for
+  // it, and then writes every change made meanwhile at once.
+  void StoreSession(ClearKeySession* aSession, uint32_t aPromiseId);
+  void WriteSessionRecords(ClearKeySession* aSession);
+  class StoreSessionFlow;
+  void StoreSessionComplete(uint32_t aSessionId,
+                            uint32_t aWrite,
+                            const std::vector<uint32_t>& aPromiseIds,
+                            bool aSucceeded);
+
+  // Records aSession's license expiration, and schedules its expiry.
+  void SetSessionExpiration(ClearKeySession* aSession,
+                            GMPTimestamp aExpiration);
+  // Marks aSession expired and adds kGMPExpired statuses for its keys to
+  // aStatuses. Appends the key IDs it held to aOutKeyIds, for the caller to
+  // release along with those of any other sessions expiring.
+  void ExpireSession(ClearKeySession* aSession,
+                     KeyStatusBatch& aStatuses,
+                     std::vector<KeyId>& aOutKeyIds);
+  // Expires every session whose expiration has passed.
+  void ExpireSessions();
+  void ScheduleExpiryTimer();
+  void ExpiryTimerFired(GMPTimestamp aDeadline);
+
+  bool IsEvictable(const ClearKeySession* aSession) const;
+  void EvictSession(ClearKeySession* aSession);
+  void EvictIdleSessions();
+  // Add and remove a persistent session's key IDs from mKeyUsage and, once
+  // its keys are back, from mEvictedKeyIds.
+  void TrackKeyUsage(const ClearKeySession* aSession);
+  void UntrackKeyUsage(const ClearKeySession* aSession);
+  void ForgetEvictedKeyIds(const ClearKeySession* aSession);
 
   RefPtr<ClearKeyDecryptionManager> mDecryptionManager;
 
   GMPDecryptorCallback* mCallback;
   GMPThread* mThread;
 
+  // Samples waiting for mThread, by lane. Guarded by mDecryptMutex.
+  GMPMutex* mDecryptMutex;
+  std::deque<DecryptRequest*> mDecryptLanes[kNumDecryptLanes];
+  uint32_t mPriorityStreak;
+
+  // Samples queued or decrypted but not yet reported to mCallback, by key
+  // ID. Main thread only.
+  std::map<KeyId, DecryptStream> mDecryptStreams;
+
+  // Samples waiting for room in the decrypt queue, in the order they arrived,
+  // and their bytes, and the totals over the samples parked in
+  // mRestoringSessions, or queued for or awaiting report from mThread. Main
+  // thread only.
+  std::deque<DecryptRequest*> mDecryptBacklog;
+  size_t mHeldDecryptBytes;
+  uint32_t mNumQueuedDecrypts;
+  size_t mQueuedDecryptBytes;
+  uint32_t mNumRejectedDecrypts;
+
+  ClearKeyInitDataCache mInitDataCache;
+
+  // Writes to persistent sessions' records made so far. Main thread only.
+  uint32_t mNumStoreWrites;
+
   std::set<KeyId> mKeyIds;
-  std::map<std::string, ClearKeySession*> mSessions;
+  std::unordered_map<uint32_t, ClearKeySession*> mSessions;
+
+  // When each key ID of a persistent session was last used to decrypt, in
+  // samples submitted, for choosing which sessions to evict, and how many
+  // persistent sessions have it. Only kept if CLEARKEY_MAX_RESIDENT_SESSIONS
+  // is set. Main thread only.
+  struct KeyUsage {
+    KeyUsage() : mLastUsed(0), mNumSessions(0) {}
+    uint64_t mLastUsed;
+    uint32_t mNumSessions;
+  };
+  uint64_t mDecryptSerial;
+  std::map<KeyId, KeyUsage> mKeyUsage;
+
+  // The key IDs of evicted sessions, and which sessions each belongs to.
+  // Main thread only.
+  std::map<KeyId, std::set<uint32_t>> mEvictedKeyIds;
+
+  // Work waiting for an evicted session's keys to be reloaded, by session.
+  // A session has an entry while its keys are being reloaded. Main thread
+  // only.
+  std::unordered_map<uint32_t, ParkedWork> mRestoringSessions;
+
+  // When each session with an expiration expires, by session. Main thread
+  // only.
+  ClearKeyTimerWheel mExpiryWheel;
+  // The deadline of the platform timer set for mExpiryWheel, or 0 if none
+  // is. GMP timers can't be cancelled, so a timer is only replaced by
+  // setting another, earlier one.
+  GMPTimestamp mExpiryTimerDeadline;
 };
 
 #endif // __ClearKeyDecryptor_h__
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ClearKeySessionTransfer.h"
+#include "ClearKeyUtils.h"
+
+#include <string>
+
+using namespace std;
+
+class TransferExportContinuation : public SessionExportContinuation {
+public:
+  explicit TransferExportContinuation(ClearKeySessionTransfer* aTransfer)
+    : mTransfer(aTransfer)
+  {
+  }
+
+  virtual void ExportComplete(GMPErr aStatus,
+                              const uint8_t* aBlob,
+                              uint32_t aBlobSize) override
+  {
+    mTransfer->ExportComplete(aStatus, aBlob, aBlobSize);
+  }
+
+private:
+  RefPtr<ClearKeySessionTransfer> mTransfer;
+};
+
+class TransferImportContinuation : public SessionImportContinuation {
+public:
+  explicit TransferImportContinuation(ClearKeySessionTransfer* aTransfer)
+    : mTransfer(aTransfer)
+  {
+  }
+
+  virtual void ImportComplete(GMPErr aStatus,
+                              const vector<ImportedSessionId>& aImported) override
+  {
+    mTransfer->ImportComplete(aStatus, aImported);
+  }
+
+private:
+  RefPtr<ClearKeySessionTransfer> mTransfer;
+};
+
+ClearKeySessionTransfer::ClearKeySessionTransfer(ClearKeySessionTransferHost* aHost)
+  : mHost(aHost)
+{
+  CK_LOGD("ClearKeySessionTransfer ctor %p", this);
+  // Dropped in TransferComplete().
+  AddRef();
+}
+
+ClearKeySessionTransfer::~ClearKeySessionTransfer()
+{
+  CK_LOGD("ClearKeySessionTransfer dtor %p", this);
+}
+
+void
+ClearKeySessionTransfer::ExportSessions()
+{
+  CK_LOGD("ClearKeySessionTransfer::ExportSessions");
+  ClearKeyPersistence::ExportSessions(new TransferExportContinuation(this));
+}
+
+void
+ClearKeySessionTransfer::ImportSessions(const uint8_t* aBlob,
+                                        uint32_t aBlobSize)
+{
+  CK_LOGD("ClearKeySessionTransfer::ImportSessions");
+  vector<uint8_t> blob(aBlob, aBlob + aBlobSize);
+  ClearKeyPersistence::ImportSessions(blob,
+                                      new TransferImportContinuation(this));
+}
+
+void
+ClearKeySessionTransfer::TransferComplete()
+{
+  CK_LOGD("ClearKeySessionTransfer::TransferComplete");
+  mHost = nullptr;
+  Release();
+}
+
+void
+ClearKeySessionTransfer::ExportComplete(GMPErr aStatus,
+                                        const uint8_t* aBlob,
+                                        uint32_t aBlobSize)
+{
+  if (mHost) {
+    mHost->ExportComplete(aStatus, aBlob, aBlobSize);
+  }
+}
+
+void
+ClearKeySessionTransfer::ImportComplete(GMPErr aStatus,
+                                        const vector<ImportedSessionId>& aImported)
+{
+  if (!mHost) {
+    return;
+  }
+
+  for (size_t i = 0; i < aImported.size(); i++) {
+    string exportedId = ClearKeyUtils::SessionIdToString(aImported[i].first);
+    string sessionId = ClearKeyUtils::SessionIdToString(aImported[i].second);
+    mHost->SessionImported(exportedId.data(), exportedId.size(),
+                           sessionId.data(), sessionId.size());
+  }
+  mHost->ImportComplete(aStatus);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ClearKeySessionTransfer_h__
+#define __ClearKeySessionTransfer_h__
+
+#include "ClearKeyPersistence.h"
+#include "gmp-api/gmp-errors.h"
+#include "RefCounted.h"
+#include <stdint.h>
+#include <vector>
+
+// API name for GMPGetAPI(), which moves all the persistent sessions stored
+// on a device into one blob and back, say when migrating a profile. The host
+// API is a ClearKeySessionTransferHost, and the plugin API a
+// ClearKeySessionTransfer.
+#define CLEARKEY_API_SESSION_TRANSFER "clearkey-session-transfer"
+
+// All calls are on the main thread, and never from within the
+// ClearKeySessionTransfer call which started the export or import.
+class ClearKeySessionTransferHost {
+public:
+  // aBlob is only valid for the duration of the call.
+  virtual void ExportComplete(GMPErr aStatus,
+                              const uint8_t* aBlob,
+                              uint32_t aBlobSize) = 0;
+
+  // Called for each session an import stored, before ImportComplete(). A
+  // session whose id was already in use on this device is stored under a
+  // new one, and must be loaded by aSessionId from now on.
+  virtual void SessionImported(const char* aExportedSessionId,
+                               uint32_t aExportedSessionIdLength,
+                               const char* aSessionId,
+                               uint32_t aSessionIdLength) = 0;
+
+  // Fails if the blob was invalid, or if any session couldn't be stored.
+  virtual void ImportComplete(GMPErr aStatus) = 0;
+
+protected:
+  virtual ~ClearKeySessionTransferHost() {}
+};
+
+class ClearKeySessionTransfer : public RefCounted {
+public:
+  explicit ClearKeySessionTransfer(ClearKeySessionTransferHost* aHost);
+
+  virtual void ExportSessions();
+  virtual void ImportSessions(const uint8_t* aBlob, uint32_t aBlobSize);
+
+  // The host won't be called after this, even for exports and imports
+  // still in progress.
+  virtual void TransferComplete();
+
+  // Report to mHost, if it's still there.
+  void ExportComplete(GMPErr aStatus,
+                      const uint8_t* aBlob,
+                      uint32_t aBlobSize);
+  void ImportComplete(GMPErr aStatus,
+                      const std::vector<ImportedSessionId>& aImported);
+
+private:
+  virtual ~ClearKeySessionTransfer();
+
+  ClearKeySessionTransferHost* mHost;
+};
+
+#endif // __ClearKeySessionTransfer_h__
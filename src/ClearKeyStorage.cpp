@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include "ClearKeyAsyncShutdown.h"
 #include "ClearKeyStorage.h"
 #include "ClearKeyUtils.h"
 
@@ -22,6 +23,11 @@
 #include <assert.h>
 #include "ArrayUtils.h"
 
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 static GMPErr
@@ -39,23 +45,131 @@ OpenRecord(const char* aName,
   return GetPlatform()->createrecord(aName, aNameLength, aOutRecord, aClient);
 }
 
+// A StoreData() caller's continuations, or a flow's write.
+struct WriteWaiter {
+  GMPTask* mOnSuccess;
+  GMPTask* mOnFailure;
+  StorageFlow* mFlow;
+};
+
+// A ReadData() caller's continuation, or a flow's read.
+struct ReadWaiter {
+  ReadContinuation* mContinuation;
+  StorageFlow* mFlow;
+};
+
+// A read or write of a record, on behalf of one or more callers.
+struct RecordOp {
+  explicit RecordOp(bool aIsWrite) : mIsWrite(aIsWrite) {}
+
+  bool mIsWrite;
+  // Writes only.
+  std::vector<uint8_t> mData;
+  std::vector<WriteWaiter> mWriters;
+  // Reads only.
+  std::vector<ReadWaiter> mReaders;
+};
+
+// The operations on a record, which run one at a time in the order they
+// were requested; the front one is in flight. Operations on different
+// records run concurrently.
+typedef std::deque<RecordOp> RecordQueue;
+
+// By record name. Main thread only.
+static std::map<std::string, RecordQueue> sRecordQueues;
+
+// Recently read or written records, most recently used first.
+struct CachedRecord {
+  std::string mName;
+  std::vector<uint8_t> mData;
+};
+
+static std::list<CachedRecord> sRecordCache;
+static std::unordered_map<std::string,
+                          std::list<CachedRecord>::iterator> sRecordCacheIndex;
+static size_t sRecordCacheBytes = 0;
+static uint32_t sRecordCacheHits = 0;
+static uint32_t sRecordCacheMisses = 0;
+
+static size_t
+CachedRecordSize(const CachedRecord& aRecord)
+{
+  return aRecord.mName.size() + aRecord.mData.size();
+}
+
+static void
+UncacheRecord(const std::string& aRecordName)
+{
+  auto itr = sRecordCacheIndex.find(aRecordName);
+  if (itr == sRecordCacheIndex.end()) {
+    return;
+  }
+  sRecordCacheBytes -= CachedRecordSize(*itr->second);
+  sRecordCache.erase(itr->second);
+  sRecordCacheIndex.erase(itr);
+}
+
+static void
+CacheRecord(const std::string& aRecordName,
+            const uint8_t* aData,
+            uint32_t aDataSize)
+{
+  UncacheRecord(aRecordName);
+  if (aRecordName.size() + aDataSize > CLEARKEY_RECORD_CACHE_BYTES) {
+    return;
+  }
+
+  sRecordCache.push_front(CachedRecord());
+  CachedRecord& record = sRecordCache.front();
+  record.mName = aRecordName;
+  Assign(record.mData, aData, aDataSize);
+  sRecordCacheIndex[aRecordName] = sRecordCache.begin();
+  sRecordCacheBytes += CachedRecordSize(record);
+
+  while (sRecordCacheBytes > CLEARKEY_RECORD_CACHE_BYTES) {
+    UncacheRecord(sRecordCache.back().mName);
+  }
+}
+
+static const CachedRecord*
+FindCachedRecord(const std::string& aRecordName)
+{
+  auto itr = sRecordCacheIndex.find(aRecordName);
+  if (itr == sRecordCacheIndex.end()) {
+    return nullptr;
+  }
+  // Move to the front, as the most recently used.
+  sRecordCache.splice(sRecordCache.begin(), sRecordCache, itr->second);
+  return &*itr->second;
+}
+
+static void StartRecordOp(const std::string& aRecordName);
+
+static void RecordOpComplete(const std::string& aRecordName,
+                             GMPErr aStatus,
+                             const uint8_t* aData,
+                             uint32_t aDataSize);
+
+// Both record clients call Close() before RecordOpComplete(), in case the
+// record's next operation is started straight away; if we call Close()
+// after, the Close() call will arrive just after the Open() call succeeds,
+// immediately closing the record we just opened.
+
 class WriteRecordClient : public GMPRecordClient {
 public:
-  /*
-   * This function will take the memory ownership of the parameters and
-   * delete them when done.
-   */
+  // Calls RecordOpComplete() when done.
+  // Takes aData's contents.
   static void Write(const std::string& aRecordName,
-                    const std::vector<uint8_t>& aData,
-                    GMPTask* aOnSuccess,
-                    GMPTask* aOnFailure) {
-    (new WriteRecordClient(aData, aOnSuccess, aOnFailure))->Do(aRecordName);
+                    std::vector<uint8_t>& aData) {
+    (new WriteRecordClient(aRecordName, aData))->Do();
   }
 
   virtual void OpenComplete(GMPErr aStatus) override {
-    if (GMP_FAILED(aStatus) ||
-        GMP_FAILED(mRecord->Write(&mData.front(), mData.size()))) {
-      Done(mOnFailure, mOnSuccess);
+    auto err = aStatus;
+    // A zero length write deletes the record.
+    if (GMP_FAILED(err) ||
+        GMP_FAILED(err = mRecord->Write(mData.data(), mData.size()))) {
+      Done(err);
     }
   }
 
@@ -66,69 +180,44 @@ public:
   }
 
   virtual void WriteComplete(GMPErr aStatus) override {
-    if (GMP_FAILED(aStatus)) {
-      Done(mOnFailure, mOnSuccess);
-    } else {
-      Done(mOnSuccess, mOnFailure);
-    }
+    Done(aStatus);
   }
 
 private:
-  WriteRecordClient(const std::vector<uint8_t>& aData,
-                    GMPTask* aOnSuccess,
-                    GMPTask* aOnFailure)
+  WriteRecordClient(const std::string& aRecordName,
+                    std::vector<uint8_t>& aData)
     : mRecord(nullptr)
-    , mOnSuccess(aOnSuccess)
-    , mOnFailure(aOnFailure)
-    , mData(aData) {}
+    , mName(aRecordName)
+  {
+    mData.swap(aData);
+  }
 
-  void Do(const std::string& aName) {
-    auto err = OpenRecord(aName.c_str(), aName.size(), &mRecord, this);
+  void Do() {
+    auto err = OpenRecord(mName.c_str(), mName.size(), &mRecord, this);
     if (GMP_FAILED(err) ||
-        GMP_FAILED(mRecord->Open())) {
-      Done(mOnFailure, mOnSuccess);
+        GMP_FAILED(err = mRecord->Open())) {
+      Done(err);
     }
   }
 
-  void Done(GMPTask* aToRun, GMPTask* aToDestroy) {
-    // Note: Call Close() before running continuation, in case the
-    // continuation tries to open the same record; if we call Close()
-    // after running the continuation, the Close() call will arrive
-    // just after the Open() call succeeds, immediately closing the
-    // record we just opened.
+  void Done(GMPErr aStatus) {
     if (mRecord) {
       mRecord->Close();
     }
-    aToDestroy->Destroy();
-    RunOnMainThread(aToRun);
+    RecordOpComplete(mName, aStatus, mData.data(), mData.size());
     delete this;
   }
 
   GMPRecord* mRecord;
-  GMPTask* mOnSuccess;
-  GMPTask* mOnFailure;
-  const std::vector<uint8_t> mData;
+  const std::string mName;
+  std::vector<uint8_t> mData;
 };
 
-void
-StoreData(const std::string& aRecordName,
-          const std::vector<uint8_t>& aData,
-          GMPTask* aOnSuccess,
-          GMPTask* aOnFailure)
-{
-  WriteRecordClient::Write(aRecordName, aData, aOnSuccess, aOnFailure);
-}
-
 class ReadRecordClient : public GMPRecordClient {
 public:
-  /*
-   * This function will take the memory ownership of the parameters and
-   * delete them when done.
-   */
-  static void Read(const std::string& aRecordName,
-                   ReadContinuation* aContinuation) {
-    assert(aContinuation);
-    (new ReadRecordClient(aContinuation))->Do(aRecordName);
+  // Calls RecordOpComplete() when done.
+  static void Read(const std::string& aRecordName) {
+    (new ReadRecordClient(aRecordName))->Do();
   }
 
   virtual void OpenComplete(GMPErr aStatus) override {
@@ -150,41 +239,240 @@ public:
   }
 
 private:
-  explicit ReadRecordClient(ReadContinuation* aContinuation)
+  explicit ReadRecordClient(const std::string& aRecordName)
     : mRecord(nullptr)
-    , mContinuation(aContinuation) {}
+    , mName(aRecordName)
+  {
+  }
 
-  void Do(const std::string& aName) {
-    auto err = OpenRecord(aName.c_str(), aName.size(), &mRecord, this);
+  void Do() {
+    auto err = OpenRecord(mName.c_str(), mName.size(), &mRecord, this);
     if (GMP_FAILED(err) ||
         GMP_FAILED(err = mRecord->Open())) {
       Done(err, nullptr, 0);
     }
   }
 
-  void Done(GMPErr err, const uint8_t* aData, uint32_t aDataSize) {
-    // Note: Call Close() before running continuation, in case the
-    // continuation tries to open the same record; if we call Close()
-    // after running the continuation, the Close() call will arrive
-    // just after the Open() call succeeds, immediately closing the
-    // record we just opened.
+  void Done(GMPErr aStatus, const uint8_t* aData, uint32_t aDataSize) {
     if (mRecord) {
       mRecord->Close();
     }
-    mContinuation->ReadComplete(err, aData, aDataSize);
-    delete mContinuation;
+    RecordOpComplete(mName, aStatus, aData, aDataSize);
     delete this;
   }
 
   GMPRecord* mRecord;
-  ReadContinuation* mContinuation;
+  const std::string mName;
 };
 
+static void
+StartRecordOp(const std::string& aRecordName)
+{
+  RecordOp& op = sRecordQueues[aRecordName].front();
+  // May complete synchronously, so op mustn't be touched after this. No
+  // further writes are coalesced into an op once it's started, so its data
+  // can be handed over.
+  if (op.mIsWrite) {
+    WriteRecordClient::Write(aRecordName, op.mData);
+  } else {
+    ReadRecordClient::Read(aRecordName);
+  }
+}
+
+// Adds an operation to the back of aRecordName's queue, starting it if
+// the record is idle.
+static void
+QueueRecordOp(const std::string& aRecordName, RecordOp& aOp)
+{
+  // Don't let the plugin shut down with the operation half done.
+  ClearKeyAsyncShutdown::BlockShutdown();
+
+  RecordQueue& queue = sRecordQueues[aRecordName];
+  queue.push_back(std::move(aOp));
+  if (queue.size() == 1) {
+    StartRecordOp(aRecordName);
+  }
+}
+
+// Flows are called inline; other callers get their task posted.
+static void
+CompleteWrite(const WriteWaiter& aWaiter, GMPErr aStatus)
+{
+  if (aWaiter.mFlow) {
+    aWaiter.mFlow->OnWritten(aStatus);
+  } else if (GMP_SUCCEEDED(aStatus)) {
+    aWaiter.mOnFailure->Destroy();
+    RunOnMainThread(aWaiter.mOnSuccess);
+  } else {
+    aWaiter.mOnSuccess->Destroy();
+    RunOnMainThread(aWaiter.mOnFailure);
+  }
+}
+
+static void
+CompleteRead(const ReadWaiter& aWaiter,
+             GMPErr aStatus,
+             const uint8_t* aData,
+             uint32_t aDataSize)
+{
+  if (aWaiter.mFlow) {
+    aWaiter.mFlow->OnRead(aStatus, aData, aDataSize);
+  } else {
+    aWaiter.mContinuation->ReadComplete(aStatus, aData, aDataSize);
+    delete aWaiter.mContinuation;
+  }
+}
+
+static void
+RecordOpComplete(const std::string& aRecordName,
+                 GMPErr aStatus,
+                 const uint8_t* aData,
+                 uint32_t aDataSize)
+{
+  auto itr = sRecordQueues.find(aRecordName);
+  assert(itr != sRecordQueues.end() && !itr->second.empty());
+
+  RecordOp op(std::move(itr->second.front()));
+  itr->second.pop_front();
+
+  // Operations on a record complete in order, so the cache sees them in
+  // order too. aData is what was read or written.
+  if (GMP_SUCCEEDED(aStatus) && (!op.mIsWrite || aDataSize)) {
+    CacheRecord(aRecordName, aData, aDataSize);
+  } else {
+    // A zero length write deleted the record, or we don't know what the
+    // record holds after a failure.
+    UncacheRecord(aRecordName);
+  }
+
+  // Start the next operation before running the continuations, so that
+  // any operations they request on the record queue up behind it.
+  if (itr->second.empty()) {
+    sRecordQueues.erase(itr);
+  } else {
+    StartRecordOp(aRecordName);
+  }
+
+  for (size_t i = 0; i < op.mWriters.size(); i++) {
+    CompleteWrite(op.mWriters[i], aStatus);
+  }
+
+  for (size_t i = 0; i < op.mReaders.size(); i++) {
+    CompleteRead(op.mReaders[i], aStatus, aData, aDataSize);
+  }
+
+  ClearKeyAsyncShutdown::UnblockShutdown();
+}
+
+static void
+QueueWrite(const std::string& aRecordName,
+           const std::vector<uint8_t>& aData,
+           const WriteWaiter& aWaiter)
+{
+  auto itr = sRecordQueues.find(aRecordName);
+  if (itr != sRecordQueues.end() &&
+      itr->second.size() > 1 &&
+      itr->second.back().mIsWrite) {
+    // Nothing can observe the data of a queued write which is followed by
+    // another write, so replace its data with ours.
+    RecordOp& op = itr->second.back();
+    op.mData = aData;
+    op.mWriters.push_back(aWaiter);
+    return;
+  }
+
+  RecordOp op(true);
+  op.mData = aData;
+  op.mWriters.push_back(aWaiter);
+  QueueRecordOp(aRecordName, op);
+}
+
+static void
+QueueRead(const std::string& aRecordName, const ReadWaiter& aWaiter)
+{
+  auto itr = sRecordQueues.find(aRecordName);
+  if (itr == sRecordQueues.end()) {
+    // The cache is up to date with storage whenever the record has no
+    // operations queued.
+    const CachedRecord* cached = FindCachedRecord(aRecordName);
+    if (cached) {
+      sRecordCacheHits++;
+      // The reader may change the cache, so give it a copy.
+      std::vector<uint8_t> data(cached->mData);
+      CompleteRead(aWaiter, GMPNoErr, data.data(), data.size());
+      return;
+    }
+  }
+
+  sRecordCacheMisses++;
+  if (itr != sRecordQueues.end() &&
+      !itr->second.back().mIsWrite) {
+    // The record will read the same for us as for the last queued read,
+    // even if it's already in flight, so share its result.
+    itr->second.back().mReaders.push_back(aWaiter);
+    return;
+  }
+
+  RecordOp op(false);
+  op.mReaders.push_back(aWaiter);
+  QueueRecordOp(aRecordName, op);
+}
+
+void
+StoreData(const std::string& aRecordName,
+          const std::vector<uint8_t>& aData,
+          GMPTask* aOnSuccess,
+          GMPTask* aOnFailure)
+{
+  WriteWaiter waiter;
+  waiter.mOnSuccess = aOnSuccess;
+  waiter.mOnFailure = aOnFailure;
+  waiter.mFlow = nullptr;
+  QueueWrite(aRecordName, aData, waiter);
+}
+
 void
 ReadData(const std::string& aRecordName,
          ReadContinuation* aContinuation)
 {
-  ReadRecordClient::Read(aRecordName, aContinuation);
+  assert(aContinuation);
+
+  ReadWaiter waiter;
+  waiter.mContinuation = aContinuation;
+  waiter.mFlow = nullptr;
+  QueueRead(aRecordName, waiter);
+}
+
+void
+StorageFlow::Read(const std::string& aRecordName)
+{
+  ReadWaiter waiter;
+  waiter.mContinuation = nullptr;
+  waiter.mFlow = this;
+  QueueRead(aRecordName, waiter);
+}
+
+void
+StorageFlow::Write(const std::string& aRecordName,
+                   const std::vector<uint8_t>& aData)
+{
+  WriteWaiter waiter;
+  waiter.mOnSuccess = nullptr;
+  waiter.mOnFailure = nullptr;
+  waiter.mFlow = this;
+  QueueWrite(aRecordName, aData, waiter);
+}
+
+uint32_t
+RecordCacheHits()
+{
+  return sRecordCacheHits;
+}
+
+uint32_t
+RecordCacheMisses()
+{
+  return sRecordCacheMisses;
 }
 
 GMPErr
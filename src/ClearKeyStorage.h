@@ -25,7 +25,22 @@
 
 class GMPTask;
 
+// Bytes of record data, including record names, which ClearKeyStorage keeps
+// in memory so that reading a record recently read or written needn't go to
+// storage. Least recently used records are evicted first. Set to 0 to
+// disable the cache.
+#ifndef CLEARKEY_RECORD_CACHE_BYTES
+#define CLEARKEY_RECORD_CACHE_BYTES (256 * 1024)
+#endif
+
+// Reads and writes of a record run one at a time, in the order they were
+// requested, while those of different records run concurrently. All are
+// main thread only.
+
 // Responsible for ensuring that both aOnSuccess and aOnFailure are destroyed.
+// Consecutive writes to a record queued behind another operation on it are
+// coalesced: only the latest data is written, and every caller's
+// continuation is run once that write has succeeded or failed.
 void StoreData(const std::string& aRecordName,
                const std::vector<uint8_t>& aData,
                GMPTask* aOnSuccess,
@@ -39,10 +54,42 @@ public:
   virtual ~ReadContinuation() {}
 };
 
-// Deletes aContinuation after running it to report the result.
+// Deletes aContinuation after running it to report the result. Reads of a
+// record which would return the same data share one read. Reads served from
+// the record cache report their result before returning.
 void ReadData(const std::string& aSessionId,
               ReadContinuation* aContinuation);
 
+// A chain of reads and writes, such as reading a record and then the records
+// it refers to, or writing an index record and then a record it lists. Each
+// operation the flow issues reports to OnRead() or OnWritten(), called
+// inline on the main thread when it completes; a read served from the
+// record cache reports before Read() returns. The flow object carries its
+// state from step to step, so a flow costs one allocation however many
+// operations it issues, and no main thread task per step. A flow has at
+// most one operation outstanding at a time, and typically deletes itself
+// when done, so it mustn't touch its members after issuing an operation.
+class StorageFlow {
+public:
+  virtual ~StorageFlow() {}
+
+  virtual void OnRead(GMPErr aStatus,
+                      const uint8_t* aData,
+                      uint32_t aLength) = 0;
+  virtual void OnWritten(GMPErr aStatus) = 0;
+
+protected:
+  // Queued, shared, coalesced and cached like ReadData() and StoreData().
+  void Read(const std::string& aRecordName);
+  void Write(const std::string& aRecordName,
+             const std::vector<uint8_t>& aData);
+};
+
+// Reads served from the record cache, and reads which had to wait on
+// storage, since the plugin was loaded. Logged at GMPShutdown().
+uint32_t RecordCacheHits();
+uint32_t RecordCacheMisses();
+
 GMPErr EnumRecordNames(RecvGMPRecordIteratorPtr aRecvIteratorFunc);
 
 #endif // __ClearKeyStorage_h__
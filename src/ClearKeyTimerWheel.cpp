@@ -0,0 +1,217 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "ClearKeyTimerWheel.h"
+
+using namespace std;
+
+static const uint64_t kTickMs = CLEARKEY_TIMER_WHEEL_TICK_MS;
+
+// Ticks are counted from the Unix epoch. A time maps to the first tick at
+// or after it, so that timers never fire early.
+static uint64_t
+TimeToTick(GMPTimestamp aTime, bool aRoundUp)
+{
+  if (aTime <= 0) {
+    return 0;
+  }
+  uint64_t time = aTime;
+  return aRoundUp ? (time + kTickMs - 1) / kTickMs : time / kTickMs;
+}
+
+ClearKeyTimerWheel::ClearKeyTimerWheel(GMPTimestamp aNow)
+  : mCurrentTick(TimeToTick(aNow, false))
+{
+  for (uint32_t level = 0; level < kNumLevels; level++) {
+    mOccupied[level] = 0;
+  }
+}
+
+void
+ClearKeyTimerWheel::Schedule(uint32_t aId, GMPTimestamp aTime)
+{
+  auto itr = mTimers.insert(make_pair(aId, Timer()));
+  Timer& timer = itr.first->second;
+  if (!itr.second) {
+    Remove(timer);
+  }
+  timer.mTick = TimeToTick(aTime, true);
+  Insert(aId, timer);
+}
+
+void
+ClearKeyTimerWheel::Cancel(uint32_t aId)
+{
+  auto itr = mTimers.find(aId);
+  if (itr == mTimers.end()) {
+    return;
+  }
+  Remove(itr->second);
+  mTimers.erase(itr);
+}
+
+// Picks the slot for aTimer relative to the next tick to be processed. A
+// timer which is n ticks away goes in the lowest level whose slots are
+// wider than n ticks. Timers too far away for even the top level wait in
+// its furthest slot, and are cascaded until they're in reach.
+static void
+PlaceTimer(uint64_t aNextTick, uint64_t aTick,
+           uint32_t aSlotBits, uint32_t aNumLevels,
+           uint32_t& aOutLevel, uint32_t& aOutSlot)
+{
+  uint64_t maxDelta = (uint64_t(1) << (aSlotBits * aNumLevels)) - 1;
+  uint64_t tick = max(aTick, aNextTick);
+  uint64_t delta = min(tick - aNextTick, maxDelta);
+  tick = aNextTick + delta;
+
+  uint32_t level = 0;
+  while (level + 1 < aNumLevels &&
+         delta >= (uint64_t(1) << (aSlotBits * (level + 1)))) {
+    level++;
+  }
+
+  aOutLevel = level;
+  aOutSlot = (tick >> (aSlotBits * level)) & ((1 << aSlotBits) - 1);
+}
+
+void
+ClearKeyTimerWheel::Insert(uint32_t aId, Timer& aTimer)
+{
+  PlaceTimer(mCurrentTick + 1, aTimer.mTick, kSlotBits, kNumLevels,
+             aTimer.mLevel, aTimer.mSlot);
+  list<uint32_t>& slot = mSlots[aTimer.mLevel][aTimer.mSlot];
+  aTimer.mPosition = slot.insert(slot.end(), aId);
+  mOccupied[aTimer.mLevel] |= uint64_t(1) << aTimer.mSlot;
+}
+
+void
+ClearKeyTimerWheel::Remove(Timer& aTimer)
+{
+  list<uint32_t>& slot = mSlots[aTimer.mLevel][aTimer.mSlot];
+  slot.erase(aTimer.mPosition);
+  if (slot.empty()) {
+    mOccupied[aTimer.mLevel] &= ~(uint64_t(1) << aTimer.mSlot);
+  }
+}
+
+void
+ClearKeyTimerWheel::Cascade(uint32_t aLevel, uint32_t aSlot)
+{
+  list<uint32_t> ids;
+  ids.swap(mSlots[aLevel][aSlot]);
+  mOccupied[aLevel] &= ~(uint64_t(1) << aSlot);
+
+  // Move each timer's list node rather than allocating a new one.
+  while (!ids.empty()) {
+    Timer& timer = mTimers[ids.front()];
+    PlaceTimer(mCurrentTick + 1, timer.mTick, kSlotBits, kNumLevels,
+               timer.mLevel, timer.mSlot);
+    list<uint32_t>& slot = mSlots[timer.mLevel][timer.mSlot];
+    slot.splice(slot.end(), ids, ids.begin());
+    timer.mPosition = --slot.end();
+    mOccupied[timer.mLevel] |= uint64_t(1) << timer.mSlot;
+  }
+}
+
+void
+ClearKeyTimerWheel::Advance(GMPTimestamp aNow, vector<uint32_t>& aOutFired)
+{
+  uint64_t nowTick = TimeToTick(aNow, false);
+
+  while (mCurrentTick < nowTick) {
+    uint32_t lowest = 0;
+    while (lowest < kNumLevels && !mOccupied[lowest]) {
+      lowest++;
+    }
+    if (lowest == kNumLevels) {
+      mCurrentTick = nowTick;
+      break;
+    }
+
+    if (lowest > 0) {
+      // Nothing happens until the lowest occupied level next cascades, so
+      // skip straight to it.
+      uint64_t span = uint64_t(1) << (kSlotBits * lowest);
+      uint64_t cascadeTick = (mCurrentTick / span + 1) * span;
+      mCurrentTick = min(cascadeTick - 1, nowTick);
+      if (mCurrentTick == nowTick) {
+        break;
+      }
+    }
+
+    // Cascade from the top down, so that timers can fall more than one
+    // level in a tick.
+    uint64_t tick = mCurrentTick + 1;
+    for (uint32_t level = kNumLevels - 1; level > 0; level--) {
+      uint32_t shift = kSlotBits * level;
+      if (!(tick & ((uint64_t(1) << shift) - 1))) {
+        Cascade(level, (tick >> shift) & (kNumSlots - 1));
+      }
+    }
+    mCurrentTick = tick;
+
+    uint32_t index = tick & (kNumSlots - 1);
+    list<uint32_t> ids;
+    ids.swap(mSlots[0][index]);
+    mOccupied[0] &= ~(uint64_t(1) << index);
+    for (auto it = ids.begin(); it != ids.end(); it++) {
+      auto timer = mTimers.find(*it);
+      if (timer->second.mTick <= tick) {
+        aOutFired.push_back(*it);
+        mTimers.erase(timer);
+      } else {
+        Insert(*it, timer->second);
+      }
+    }
+  }
+}
+
+bool
+ClearKeyTimerWheel::NextDeadline(GMPTimestamp& aOutDeadline) const
+{
+  if (mTimers.empty()) {
+    return false;
+  }
+
+  uint64_t nextTick = mCurrentTick + 1;
+  uint64_t deadline = UINT64_MAX;
+
+  // The first occupied level 0 slot fires...
+  for (uint32_t i = 0; i < kNumSlots; i++) {
+    if (mOccupied[0] & (uint64_t(1) << ((nextTick + i) & (kNumSlots - 1)))) {
+      deadline = nextTick + i;
+      break;
+    }
+  }
+
+  // ...unless a higher level cascades timers down before then.
+  for (uint32_t level = 1; level < kNumLevels; level++) {
+    uint32_t shift = kSlotBits * level;
+    uint64_t firstBlock = (nextTick + (uint64_t(1) << shift) - 1) >> shift;
+    for (uint32_t i = 0; i < kNumSlots; i++) {
+      uint64_t block = firstBlock + i;
+      if (mOccupied[level] & (uint64_t(1) << (block & (kNumSlots - 1)))) {
+        deadline = min(deadline, block << shift);
+        break;
+      }
+    }
+  }
+
+  aOutDeadline = deadline * kTickMs;
+  return true;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2015, Mozilla Foundation and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ClearKeyTimerWheel_h__
+#define __ClearKeyTimerWheel_h__
+
+#include <list>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "gmp-api/gmp-platform.h"
+
+// Resolution, in milliseconds, of the times ClearKeyTimerWheel schedules. A
+// timer never fires early, but may fire up to this much late.
+#ifndef CLEARKEY_TIMER_WHEEL_TICK_MS
+#define CLEARKEY_TIMER_WHEEL_TICK_MS 250
+#endif
+
+// Timers for many ids, such as session expiry times, with O(1) scheduling
+// and cancellation. Timers are kept in a hierarchy of wheels of slots; each
+// level's slots cover 64 times the ticks of the level below's, and a slot's
+// timers are cascaded down to the level below when the wheel's time reaches
+// it. The wheel doesn't keep time itself: the owner calls Advance() when
+// NextDeadline() comes around. Main thread only.
+class ClearKeyTimerWheel
+{
+public:
+  explicit ClearKeyTimerWheel(GMPTimestamp aNow);
+
+  // Schedules aId's timer to fire at aTime, replacing any it already has.
+  // Times which have already passed fire at the next tick.
+  void Schedule(uint32_t aId, GMPTimestamp aTime);
+
+  void Cancel(uint32_t aId);
+
+  // Moves the wheel's time on to aNow, appending the ids whose timers have
+  // fired to aOutFired.
+  void Advance(GMPTimestamp aNow, std::vector<uint32_t>& aOutFired);
+
+  // When Advance() next needs calling, either to fire timers or to cascade
+  // them. Returns false if no timers are scheduled.
+  bool NextDeadline(GMPTimestamp& aOutDeadline) const;
+
+  bool IsEmpty() const { return mTimers.empty(); }
+
+private:
+  static const uint32_t kSlotBits = 6;
+  static const uint32_t kNumSlots = 1 << kSlotBits;
+  static const uint32_t kNumLevels = 4;
+
+  struct Timer
+  {
+    // When the timer fires, in ticks.
+    uint64_t mTick;
+    uint32_t mLevel;
+    uint32_t mSlot;
+    std::list<uint32_t>::iterator mPosition;
+  };
+
+  void Insert(uint32_t aId, Timer& aTimer);
+  void Remove(Timer& aTimer);
+  // Reinserts the timers of a slot, now that the wheel's time has reached
+  // it.
+  void Cascade(uint32_t aLevel, uint32_t aSlot);
+
+  // The tick the wheel's time is at; every timer fires after it.
+  uint64_t mCurrentTick;
+
+  std::unordered_map<uint32_t, Timer> mTimers;
+  std::list<uint32_t> mSlots[kNumLevels][kNumSlots];
+  // Bit i is set if slot i of the level has timers.
+  uint64_t mOccupied[kNumLevels];
+};
+
+#endif // __ClearKeyTimerWheel_h__
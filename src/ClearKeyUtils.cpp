@@ -18,11 +18,11 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 
 #include "ClearKeyUtils.h"
 #include "ClearKeyBase64.h"
-#include "ArrayUtils.h"
 #include <assert.h>
 #include <memory.h>
 #include "Endian.h"
@@ -89,104 +89,114 @@ ClearKeyUtils::DecryptAES(const vector<uint8_t>& aKey,
   oaes_free(&aes);
 }
 
-/**
- * ClearKey expects all Key IDs to be base64 encoded with non-standard alphabet
- * and padding.
- */
-static bool
-EncodeBase64Web(vector<uint8_t> aBinary, string& aEncoded)
+/* static */ bool
+ClearKeyUtils::ScanCENCInitData(const uint8_t* aInitData,
+                                uint32_t aInitDataSize,
+                                vector<const uint8_t*>& aOutKeyIds)
 {
-  const char sAlphabet[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
-  const uint8_t sMask = 0x3f;
-
-  aEncoded.resize((aBinary.size() * 8 + 5) / 6);
-
-  // Pad binary data in case there's rubbish past the last byte.
-  aBinary.push_back(0);
+  using mozilla::BigEndian;
 
-  // Number of bytes not consumed in the previous character
-  uint32_t shift = 0;
+  const uint8_t* end = aInitData + aInitDataSize;
+  const uint8_t* boxStart = aInitData;
 
-  auto out = aEncoded.begin();
-  auto data = aBinary.begin();
-  for (string::size_type i = 0; i < aEncoded.length(); i++) {
-    if (shift) {
-      out[i] = (*data << (6 - shift)) & sMask;
-      data++;
-    } else {
-      out[i] = 0;
+  while (boxStart < end) {
+    if (end - boxStart < 8) {
+      CK_LOGE("Box header overflows init data buffer");
+      return false;
     }
 
-    out[i] += (*data >> (shift + 2)) & sMask;
-    shift = (shift + 2) % 8;
-
-    // Cast idx to size_t before using it as an array-index,
-    // to pacify clang 'Wchar-subscripts' warning:
-    size_t idx = static_cast<size_t>(out[i]);
-    assert(idx < MOZ_ARRAY_LENGTH(sAlphabet)); // out of bounds index for 'sAlphabet'
-    out[i] = sAlphabet[idx];
-  }
-
-  return true;
-}
-
-/* static */ void
-ClearKeyUtils::ParseCENCInitData(const uint8_t* aInitData,
-                                 uint32_t aInitDataSize,
-                                 vector<KeyId>& aOutKeyIds)
-{
-  using mozilla::BigEndian;
-
-  uint32_t size = 0;
-  for (uint32_t offset = 0; offset + sizeof(uint32_t) < aInitDataSize; offset += size) {
-    const uint8_t* data = aInitData + offset;
-    size = BigEndian::readUint32(data); data += sizeof(uint32_t);
+    uint64_t size = BigEndian::readUint32(boxStart);
+    uint32_t box = BigEndian::readUint32(boxStart + 4);
+    const uint8_t* data = boxStart + 8;
 
-    CK_LOGD("Looking for pssh at offset %u", offset);
+    if (size == 1) {
+      // A 64 bit size follows the box type.
+      if (end - data < 8) {
+        CK_LOGE("Box largesize overflows init data buffer");
+        return false;
+      }
+      size = BigEndian::readUint64(data);
+      data += 8;
+    } else if (size == 0) {
+      // The box extends to the end of the buffer.
+      size = end - boxStart;
+    }
 
-    if (size + offset > aInitDataSize) {
-      CK_LOGE("Box size %u overflows init data buffer", size);
-      return;
+    if (size < uint64_t(data - boxStart) || size > uint64_t(end - boxStart)) {
+      CK_LOGE("Box size %llu is invalid", (unsigned long long)size);
+      return false;
     }
 
-    if (size < 36) {
-      // Too small to be a cenc2 pssh box
+    const uint8_t* boxEnd = boxStart + size;
+    boxStart = boxEnd;
+
+    if (box != FOURCC('p','s','s','h')) {
+      CK_LOGD("Skipping non-pssh box");
       continue;
     }
 
-    uint32_t box = BigEndian::readUint32(data); data += sizeof(uint32_t);
-    if (box != FOURCC('p','s','s','h')) {
-      CK_LOGE("ClearKey CDM passed non-pssh initData");
-      return;
+    // Full box version and flags, followed by the system ID.
+    if (boxEnd - data < 4 + ptrdiff_t(sizeof(kSystemID))) {
+      CK_LOGE("pssh box too small for its header");
+      return false;
     }
 
     uint32_t head = BigEndian::readUint32(data); data += sizeof(uint32_t);
-    CK_LOGD("Got version %u pssh box, length %u", head & 0xff, size);
+    CK_LOGD("Got version %u pssh box, length %llu", head >> 24,
+            (unsigned long long)size);
 
-    if ((head >> 24) != 1) {
-      // Ignore pssh boxes with wrong version
-      CK_LOGD("Ignoring pssh box with wrong version");
+    if (memcmp(kSystemID, data, sizeof(kSystemID))) {
+      // Ignore pssh boxes for other key systems.
       continue;
     }
+    data += sizeof(kSystemID);
 
-    if (memcmp(kSystemID, data, sizeof(kSystemID))) {
-      // Ignore pssh boxes with wrong system ID
+    if (!(head >> 24)) {
+      // Version 0 pssh boxes don't list key IDs.
+      CK_LOGD("Ignoring version 0 pssh box");
       continue;
     }
-    data += sizeof(kSystemID);
 
+    if (boxEnd - data < 4) {
+      CK_LOGE("pssh box too small for its key ID count");
+      return false;
+    }
     uint32_t kidCount = BigEndian::readUint32(data); data += sizeof(uint32_t);
-    if (data + kidCount * CLEARKEY_KEY_LEN > aInitData + aInitDataSize) {
-      CK_LOGE("pssh key IDs overflow init data buffer");
-      return;
+    if (kidCount > (boxEnd - data) / CLEARKEY_KEY_LEN) {
+      CK_LOGE("pssh key IDs overflow box");
+      return false;
     }
 
     for (uint32_t i = 0; i < kidCount; i++) {
-      aOutKeyIds.push_back(KeyId(data, data + CLEARKEY_KEY_LEN));
+      aOutKeyIds.push_back(data);
       data += CLEARKEY_KEY_LEN;
     }
   }
+
+  return true;
+}
+
+/* static */ void
+ClearKeyUtils::ParseCENCInitData(const uint8_t* aInitData,
+                                 uint32_t aInitDataSize,
+                                 vector<KeyId>& aOutKeyIds)
+{
+  vector<const uint8_t*> keyIds;
+  if (!ScanCENCInitData(aInitData, aInitDataSize, keyIds)) {
+    CK_LOGW("ClearKey CDM passed malformed cenc initData");
+  }
+
+  aOutKeyIds.reserve(aOutKeyIds.size() + keyIds.size());
+  for (size_t i = 0; i < keyIds.size(); i++) {
+    aOutKeyIds.push_back(KeyId(keyIds[i], keyIds[i] + CLEARKEY_KEY_LEN));
+  }
+}
+
+static char*
+WriteChars(char* aOut, const char* aChars, size_t aLength)
+{
+  memcpy(aOut, aChars, aLength);
+  return aOut + aLength;
 }
 
 /* static */ void
@@ -196,24 +206,46 @@ ClearKeyUtils::MakeKeyRequest(const vector<KeyId>& aKeyIDs,
 {
   assert(aKeyIDs.size() && aOutRequest.empty());
 
-  aOutRequest.append("{\"kids\":[");
+  static const char kKidsPrefix[] = "{\"kids\":[";
+  static const char kTypePrefix[] = "],\"type\":\"";
+  static const char kSuffix[] = "\"}";
+  const char* type = SessionTypeToString(aSessionType);
+  size_t typeLength = strlen(type);
+
+  // Size the request exactly up front, so it's written with one allocation.
+  // Each key ID is quoted, and followed by a comma unless it's the last.
+  size_t length = sizeof(kKidsPrefix) - 1 +
+                  aKeyIDs.size() * 3 - 1 +
+                  sizeof(kTypePrefix) - 1 +
+                  typeLength +
+                  sizeof(kSuffix) - 1;
+  for (size_t i = 0; i < aKeyIDs.size(); i++) {
+    length += Base64WebEncodedLength(aKeyIDs[i].size());
+  }
+
+  aOutRequest.resize(length);
+  char* out = &aOutRequest[0];
+
+  out = WriteChars(out, kKidsPrefix, sizeof(kKidsPrefix) - 1);
   for (size_t i = 0; i < aKeyIDs.size(); i++) {
     if (i) {
-      aOutRequest.append(",");
+      *out++ = ',';
     }
-    aOutRequest.append("\"");
+    *out++ = '"';
 
-    string base64key;
-    EncodeBase64Web(aKeyIDs[i], base64key);
-    aOutRequest.append(base64key);
+    const KeyId& keyId = aKeyIDs[i];
+    if (!keyId.empty()) {
+      EncodeBase64Web(&keyId[0], keyId.size(), out);
+    }
+    out += Base64WebEncodedLength(keyId.size());
 
-    aOutRequest.append("\"");
+    *out++ = '"';
   }
-  aOutRequest.append("],\"type\":");
+  out = WriteChars(out, kTypePrefix, sizeof(kTypePrefix) - 1);
+  out = WriteChars(out, type, typeLength);
+  out = WriteChars(out, kSuffix, sizeof(kSuffix) - 1);
 
-  aOutRequest.append("\"");
-  aOutRequest.append(SessionTypeToString(aSessionType));
-  aOutRequest.append("\"}");
+  assert(out == &aOutRequest[0] + aOutRequest.size());
 }
 
 #define EXPECT_SYMBOL(CTX, X) do { \
@@ -228,6 +260,23 @@ struct ParserContext {
   const uint8_t* mEnd;
 };
 
+// A range of the buffer being parsed. Lets the parser refer to labels and
+// values without copying them out of the buffer.
+struct ParserSpan {
+  ParserSpan() : mBegin(nullptr), mEnd(nullptr) {}
+  bool IsEmpty() const { return mBegin == mEnd; }
+  size_t Length() const { return mEnd - mBegin; }
+  const uint8_t* mBegin;
+  const uint8_t* mEnd;
+};
+
+static bool
+SpanEquals(const ParserSpan& aSpan, const char* aString)
+{
+  size_t length = strlen(aString);
+  return aSpan.Length() == length && !memcmp(aSpan.mBegin, aString, length);
+}
+
 static uint8_t
 PeekSymbol(ParserContext& aCtx)
 {
@@ -356,7 +405,7 @@ SkipToken(ParserContext& aCtx)
 }
 
 static bool
-GetNextLabel(ParserContext& aCtx, string& aOutLabel)
+GetNextLabel(ParserContext& aCtx, ParserSpan& aOutLabel)
 {
   EXPECT_SYMBOL(aCtx, '"');
 
@@ -368,7 +417,8 @@ GetNextLabel(ParserContext& aCtx, string& aOutLabel)
     }
 
     if (sym == '"') {
-      aOutLabel.assign(start, aCtx.mIter - 1);
+      aOutLabel.mBegin = start;
+      aOutLabel.mEnd = aCtx.mIter - 1;
       return true;
     }
   }
@@ -376,17 +426,40 @@ GetNextLabel(ParserContext& aCtx, string& aOutLabel)
   return false;
 }
 
+// Parses a non-negative integer, as used for times in licenses. Fails if
+// the number may continue past the end of the input.
 static bool
-DecodeKey(string& aEncoded, Key& aOutDecoded)
+ParseTimestamp(ParserContext& aCtx, GMPTimestamp& aOutTimestamp)
 {
-  return
-    DecodeBase64KeyOrId(aEncoded, aOutDecoded) &&
-    // Key should be 128 bits long.
-    aOutDecoded.size() == CLEARKEY_KEY_LEN;
+  PeekSymbol(aCtx);
+
+  const uint8_t* start = aCtx.mIter;
+  uint64_t value = 0;
+  for (; aCtx.mIter < aCtx.mEnd && isdigit(*aCtx.mIter); aCtx.mIter++) {
+    if (value > (INT64_MAX - 9) / 10) {
+      return false;
+    }
+    value = value * 10 + (*aCtx.mIter - '0');
+  }
+
+  if (aCtx.mIter == start || aCtx.mIter >= aCtx.mEnd) {
+    return false;
+  }
+
+  aOutTimestamp = value;
+  return true;
 }
 
 static bool
-ParseKeyObject(ParserContext& aCtx, KeyIdPair& aOutKey)
+DecodeKeyOrId(const ParserSpan& aEncoded, uint8_t* aOutDecoded)
+{
+  return DecodeBase64KeyOrId(aEncoded.mBegin, aEncoded.Length(), aOutDecoded);
+}
+
+static bool
+ParseKeyObject(ParserContext& aCtx,
+               uint8_t aOutKeyId[CLEARKEY_KEY_LEN],
+               uint8_t aOutKey[CLEARKEY_KEY_LEN])
 {
   EXPECT_SYMBOL(aCtx, '{');
 
@@ -396,26 +469,26 @@ ParseKeyObject(ParserContext& aCtx, KeyIdPair& aOutKey)
     return false;
   }
 
-  string keyId;
-  string key;
+  ParserSpan keyId;
+  ParserSpan key;
 
   while (true) {
-    string label;
-    string value;
+    ParserSpan label;
+    ParserSpan value;
 
     if (!GetNextLabel(aCtx, label)) {
       return false;
     }
 
     EXPECT_SYMBOL(aCtx, ':');
-    if (label == "kty") {
+    if (SpanEquals(label, "kty")) {
       if (!GetNextLabel(aCtx, value)) return false;
       // By spec, type must be "oct".
-      if (value != "oct") return false;
-    } else if (label == "k" && PeekSymbol(aCtx) == '"') {
+      if (!SpanEquals(value, "oct")) return false;
+    } else if (SpanEquals(label, "k") && PeekSymbol(aCtx) == '"') {
       // if this isn't a string we will fall through to the SkipToken() path.
       if (!GetNextLabel(aCtx, key)) return false;
-    } else if (label == "kid" && PeekSymbol(aCtx) == '"') {
+    } else if (SpanEquals(label, "kid") && PeekSymbol(aCtx) == '"') {
       if (!GetNextLabel(aCtx, keyId)) return false;
     } else {
       if (!SkipToken(aCtx)) return false;
@@ -428,85 +501,210 @@ ParseKeyObject(ParserContext& aCtx, KeyIdPair& aOutKey)
     EXPECT_SYMBOL(aCtx, ',');
   }
 
-  return !key.empty() &&
-         !keyId.empty() &&
-         DecodeBase64KeyOrId(keyId, aOutKey.mKeyId) &&
-         DecodeKey(key, aOutKey.mKey) &&
+  // Keys and key IDs should both be 128 bits long.
+  return !key.IsEmpty() &&
+         !keyId.IsEmpty() &&
+         DecodeKeyOrId(keyId, aOutKeyId) &&
+         DecodeKeyOrId(key, aOutKey) &&
          GetNextSymbol(aCtx) == '}';
 }
 
-static bool
-ParseKeys(ParserContext& aCtx, vector<KeyIdPair>& aOutKeys)
+ClearKeyLicenseParser::ClearKeyLicenseParser(GMPSessionType aSessionType,
+                                             KeyHandler* aHandler)
+  : mSessionType(aSessionType)
+  , mHandler(aHandler)
+  , mState(kObjectStart)
+  , mSkippingKeys(false)
 {
-  // Consume start of array.
-  EXPECT_SYMBOL(aCtx, '[');
-
-  while (true) {
-    KeyIdPair key;
-    if (!ParseKeyObject(aCtx, key)) {
-      CK_LOGE("Failed to parse key object");
-      return false;
-    }
+}
 
-    assert(!key.mKey.empty() && !key.mKeyId.empty());
-    aOutKeys.push_back(key);
+bool
+ClearKeyLicenseParser::Append(const uint8_t* aData, uint32_t aLength)
+{
+  if (!IsParsing() || !aLength) {
+    return mState != kError;
+  }
 
-    uint8_t sym = PeekSymbol(aCtx);
-    if (!sym || sym == ']') {
-      break;
+  if (mPending.empty()) {
+    // Parse straight out of the caller's buffer, and only hold on to the
+    // trailing partial value, if any.
+    size_t consumed = Parse(aData, aData + aLength, false);
+    if (IsParsing()) {
+      Assign(mPending, aData + consumed, aLength - consumed);
     }
+  } else {
+    mPending.insert(mPending.end(), aData, aData + aLength);
+    size_t consumed = Parse(&mPending[0], &mPending[0] + mPending.size(), false);
+    if (IsParsing()) {
+      mPending.erase(mPending.begin(), mPending.begin() + consumed);
+    } else {
+      vector<uint8_t>().swap(mPending);
+    }
+  }
 
-    EXPECT_SYMBOL(aCtx, ',');
+  return mState != kError;
+}
+
+bool
+ClearKeyLicenseParser::Finish()
+{
+  if (IsParsing()) {
+    static const uint8_t sEmpty = 0;
+    const uint8_t* begin = mPending.empty() ? &sEmpty : &mPending[0];
+    Parse(begin, begin + mPending.size(), true);
+    vector<uint8_t>().swap(mPending);
   }
 
-  return GetNextSymbol(aCtx) == ']';
+  return mState == kDone;
 }
 
-/* static */ bool
-ClearKeyUtils::ParseJWK(const uint8_t* aKeyData, uint32_t aKeyDataSize,
-                        vector<KeyIdPair>& aOutKeys,
-                        GMPSessionType aSessionType)
+size_t
+ClearKeyLicenseParser::Parse(const uint8_t* aBegin, const uint8_t* aEnd,
+                             bool aIsFinal)
 {
   ParserContext ctx;
-  ctx.mIter = aKeyData;
-  ctx.mEnd = aKeyData + aKeyDataSize;
+  ctx.mIter = aBegin;
+  ctx.mEnd = aEnd;
 
-  // Consume '{' from start of object.
-  EXPECT_SYMBOL(ctx, '{');
+  while (IsParsing() && ParseNext(ctx, aIsFinal)) {}
 
-  while (true) {
-    string label;
-    // Consume member key.
-    if (!GetNextLabel(ctx, label)) return false;
-    EXPECT_SYMBOL(ctx, ':');
+  return std::min(ctx.mIter, aEnd) - aBegin;
+}
 
-    if (label == "keys") {
-      // Parse "keys" array.
-      if (!ParseKeys(ctx, aOutKeys)) return false;
-    } else if (label == "type") {
-      // Consume type string.
-      string type;
-      if (!GetNextLabel(ctx, type)) return false;
-      if (type != SessionTypeToString(aSessionType)) {
-        return false;
+/**
+ * Parses the next member label, value or separator of the license. Returns
+ * false if parsing can't continue, either because the state has moved to
+ * kDone or kError, or because the value runs off the end of the
+ * input and more is needed; in the latter case the context is rewound to
+ * the start of the value.
+ */
+bool
+ClearKeyLicenseParser::ParseNext(ParserContext& aCtx, bool aIsFinal)
+{
+  const uint8_t* start = aCtx.mIter;
+  State next = kError;
+
+  switch (mState) {
+    case kObjectStart:
+      if (GetNextSymbol(aCtx) == '{') {
+        next = kMemberLabel;
       }
-    } else {
-      SkipToken(ctx);
+      break;
+
+    case kMemberLabel: {
+      ParserSpan label;
+      if (GetNextLabel(aCtx, label) && GetNextSymbol(aCtx) == ':') {
+        if (SpanEquals(label, "keys")) {
+          next = kKeysStart;
+        } else if (SpanEquals(label, "type")) {
+          next = kMemberType;
+        } else if (SpanEquals(label, "expiration")) {
+          next = kMemberExpiration;
+        } else {
+          next = kMemberSkip;
+        }
+      }
+      break;
     }
 
-    // Check for end of object.
-    if (PeekSymbol(ctx) == '}') {
+    case kMemberType: {
+      ParserSpan type;
+      if (GetNextLabel(aCtx, type)) {
+        if (!SpanEquals(type, ClearKeyUtils::SessionTypeToString(mSessionType))) {
+          // A license for another type of session is never acceptable, even
+          // once the key handler has every key it wants.
+          CK_LOGE("JWK session type doesn't match");
+          mState = kError;
+          return false;
+        }
+        next = kMemberEnd;
+      }
       break;
     }
 
-    // Consume ',' between object members.
-    EXPECT_SYMBOL(ctx, ',');
+    case kMemberExpiration: {
+      GMPTimestamp expiration;
+      if (ParseTimestamp(aCtx, expiration)) {
+        mHandler->OnExpiration(expiration);
+        next = kMemberEnd;
+      }
+      break;
+    }
+
+    case kMemberSkip:
+      // Values of unknown members only need to be skipped over; a malformed
+      // one will fail the separator check that follows.
+      if (SkipToken(aCtx) || aIsFinal || aCtx.mIter < aCtx.mEnd) {
+        next = kMemberEnd;
+      }
+      break;
+
+    case kMemberEnd: {
+      uint8_t sym = GetNextSymbol(aCtx);
+      if (sym == '}') {
+        next = kDone;
+      } else if (sym == ',') {
+        next = kMemberLabel;
+      }
+      break;
+    }
+
+    case kKeysStart:
+      if (GetNextSymbol(aCtx) == '[') {
+        next = kKey;
+      }
+      break;
+
+    case kKey: {
+      if (mSkippingKeys) {
+        if (SkipToken(aCtx)) {
+          next = kKeyEnd;
+        }
+        break;
+      }
+
+      uint8_t keyId[CLEARKEY_KEY_LEN];
+      uint8_t key[CLEARKEY_KEY_LEN];
+      if (ParseKeyObject(aCtx, keyId, key)) {
+        if (!mHandler->OnKey(keyId, key)) {
+          // Keep going in case other members, such as the expiration,
+          // follow the keys.
+          CK_LOGD("JWK parser skipping keys at key handler's request");
+          mSkippingKeys = true;
+        }
+        next = kKeyEnd;
+      }
+      break;
+    }
+
+    case kKeyEnd: {
+      uint8_t sym = GetNextSymbol(aCtx);
+      if (sym == ']') {
+        next = kMemberEnd;
+      } else if (sym == ',') {
+        next = kKey;
+      }
+      break;
+    }
+
+    default:
+      return false;
   }
 
-  // Consume '}' from end of object.
-  EXPECT_SYMBOL(ctx, '}');
+  if (next != kError) {
+    mState = next;
+    return true;
+  }
 
-  return true;
+  if (!aIsFinal && aCtx.mIter >= aCtx.mEnd) {
+    // Ran out of input part way through; wait for more.
+    aCtx.mIter = start;
+    return false;
+  }
+
+  CK_LOGE("Failed to parse JWK");
+  mState = kError;
+  return false;
 }
 
 static bool
@@ -516,14 +714,13 @@ ParseKeyIds(ParserContext& aCtx, vector<KeyId>& aOutKeyIds)
   EXPECT_SYMBOL(aCtx, '[');
 
   while (true) {
-    string label;
-    vector<uint8_t> keyId;
+    ParserSpan label;
+    uint8_t keyId[CLEARKEY_KEY_LEN];
     if (!GetNextLabel(aCtx, label) ||
-        !DecodeBase64KeyOrId(label, keyId)) {
+        !DecodeKeyOrId(label, keyId)) {
       return false;
     }
-    assert(!keyId.empty());
-    aOutKeyIds.push_back(keyId);
+    aOutKeyIds.push_back(KeyId(keyId, keyId + CLEARKEY_KEY_LEN));
 
     uint8_t sym = PeekSymbol(aCtx);
     if (!sym || sym == ']') {
@@ -553,17 +750,19 @@ ClearKeyUtils::ParseKeyIdsInitData(const uint8_t* aInitData,
   EXPECT_SYMBOL(ctx, '{');
 
   while (true) {
-    string label;
+    ParserSpan label;
     // Consume member kids.
     if (!GetNextLabel(ctx, label)) return false;
     EXPECT_SYMBOL(ctx, ':');
 
-    if (label == "kids") {
+    if (SpanEquals(label, "kids")) {
       // Parse "kids" array.
       if (!ParseKeyIds(ctx, aOutKeyIds)) return false;
-    } else if (label == "type") {
+    } else if (SpanEquals(label, "type")) {
       // Consume type string.
-      if (!GetNextLabel(ctx, aOutSessionType)) return false;
+      ParserSpan type;
+      if (!GetNextLabel(ctx, type)) return false;
+      aOutSessionType.assign(type.mBegin, type.mEnd);
     } else {
       SkipToken(ctx);
     }
@@ -597,21 +796,44 @@ ClearKeyUtils::SessionTypeToString(GMPSessionType aSessionType)
 }
 
 /* static */ bool
-ClearKeyUtils::IsValidSessionId(const char* aBuff, uint32_t aLength)
+ClearKeyUtils::ParseSessionId(const char* aBuff, uint32_t aLength,
+                              uint32_t& aOutSessionId)
 {
-  if (aLength > 10) {
+  if (!aLength || aLength > 10 || (aBuff[0] == '0' && aLength > 1)) {
     // 10 is the max number of characters in UINT32_MAX when
     // represented as a string; ClearKey session ids are integers.
     return false;
   }
+
+  uint64_t sessionId = 0;
   for (uint32_t i = 0; i < aLength; i++) {
     if (!isdigit(aBuff[i])) {
       return false;
     }
+    sessionId = sessionId * 10 + (aBuff[i] - '0');
+  }
+  if (sessionId > UINT32_MAX) {
+    return false;
   }
+
+  aOutSessionId = (uint32_t)sessionId;
   return true;
 }
 
+/* static */ string
+ClearKeyUtils::SessionIdToString(uint32_t aSessionId)
+{
+  char buffer[10];
+  char* end = buffer + sizeof(buffer);
+  char* digits = end;
+  do {
+    *--digits = '0' + aSessionId % 10;
+    aSessionId /= 10;
+  } while (aSessionId);
+
+  return string(digits, end);
+}
+
 GMPMutex* GMPCreateMutex() {
   GMPMutex* mutex;
   auto err = GetPlatform()->createmutex(&mutex);
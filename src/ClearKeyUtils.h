@@ -54,6 +54,14 @@ public:
   static void DecryptAES(const std::vector<uint8_t>& aKey,
                          std::vector<uint8_t>& aData, std::vector<uint8_t>& aIV);
 
+  // Scans CENC init data, a sequence of ISO BMFF boxes, for the key IDs in
+  // ClearKey 'pssh' boxes, skipping other boxes. Appends a pointer into
+  // aInitData for each CLEARKEY_KEY_LEN byte key ID found. Returns false if
+  // the boxes are malformed; key IDs found before that are still appended.
+  static bool ScanCENCInitData(const uint8_t* aInitData,
+                               uint32_t aInitDataSize,
+                               std::vector<const uint8_t*>& aOutKeyIds);
+
   static void ParseCENCInitData(const uint8_t* aInitData,
                                 uint32_t aInitDataSize,
                                 std::vector<Key>& aOutKeyIds);
@@ -67,12 +75,80 @@ public:
                              std::string& aOutRequest,
                              GMPSessionType aSessionType);
 
-  static bool ParseJWK(const uint8_t* aKeyData, uint32_t aKeyDataSize,
-                       std::vector<KeyIdPair>& aOutKeys,
-                       GMPSessionType aSessionType);
   static const char* SessionTypeToString(GMPSessionType aSessionType);
 
-  static bool IsValidSessionId(const char* aBuff, uint32_t aLength);
+  // Session IDs are decimal uint32_t's, without leading zeros. Returns false
+  // if aBuff isn't a session ID.
+  static bool ParseSessionId(const char* aBuff, uint32_t aLength,
+                             uint32_t& aOutSessionId);
+  // Always short enough to be stored without allocating.
+  static std::string SessionIdToString(uint32_t aSessionId);
+};
+
+struct ParserContext;
+
+// Incrementally parses a JSON Web Key Set license. The license may be fed in
+// arbitrarily sized chunks; each key is handed to the KeyHandler as soon as
+// its key object has been parsed. Only input not yet consumed by a complete
+// JSON value is kept between chunks.
+class ClearKeyLicenseParser
+{
+public:
+  class KeyHandler
+  {
+  public:
+    // Called with the CLEARKEY_KEY_LEN byte key ID and key of each key in
+    // the license. Return false to skip the rest of the keys; they're still
+    // checked to be well formed JSON, and the license's other members are
+    // still parsed.
+    virtual bool OnKey(const uint8_t* aKeyId, const uint8_t* aKey) = 0;
+
+    // Called if the license has an "expiration" member, an integer number
+    // of milliseconds since the Unix epoch after which its keys mustn't be
+    // used. This is an extension to the JSON Web Key Set format.
+    virtual void OnExpiration(GMPTimestamp aExpiration) {}
+
+  protected:
+    virtual ~KeyHandler() {}
+  };
+
+  ClearKeyLicenseParser(GMPSessionType aSessionType, KeyHandler* aHandler);
+
+  // Parses as much of aData as possible. Returns false once the license is
+  // known to be malformed.
+  bool Append(const uint8_t* aData, uint32_t aLength);
+
+  // Call once all of the license has been appended. Returns true if the
+  // license was well formed, and for this parser's session type.
+  bool Finish();
+
+private:
+  enum State {
+    kObjectStart,
+    kMemberLabel,
+    kMemberType,
+    kMemberExpiration,
+    kMemberSkip,
+    kMemberEnd,
+    kKeysStart,
+    kKey,
+    kKeyEnd,
+    kDone,
+    kError
+  };
+
+  bool IsParsing() const { return mState < kDone; }
+  size_t Parse(const uint8_t* aBegin, const uint8_t* aEnd, bool aIsFinal);
+  bool ParseNext(ParserContext& aCtx, bool aIsFinal);
+
+  GMPSessionType mSessionType;
+  KeyHandler* mHandler;
+  State mState;
+  // Set once the KeyHandler has asked to skip the rest of the keys.
+  bool mSkippingKeys;
+
+  // Input that has been appended but not yet consumed.
+  std::vector<uint8_t> mPending;
 };
 
 template<class Container, class Element>
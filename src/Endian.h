@@ -50,6 +50,20 @@ public:
            uint64_t(p[7]);
   }
 
+  static void writeUint16(void* aPtr, uint16_t aValue) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(aPtr);
+    p[0] = uint8_t(aValue >> 8) & 0xff;
+    p[1] = uint8_t(aValue) & 0xff;
+  }
+
+  static void writeUint32(void* aPtr, uint32_t aValue) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(aPtr);
+    p[0] = uint8_t(aValue >> 24) & 0xff;
+    p[1] = uint8_t(aValue >> 16) & 0xff;
+    p[2] = uint8_t(aValue >> 8) & 0xff;
+    p[3] = uint8_t(aValue) & 0xff;
+  }
+
   static void writeUint64(void* aPtr, uint64_t aValue) {
     uint8_t* p = reinterpret_cast<uint8_t*>(aPtr);
     p[0] = uint8_t(aValue >> 56) & 0xff;
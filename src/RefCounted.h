@@ -17,55 +17,24 @@
 #ifndef __RefCount_h__
 #define __RefCount_h__
 
+#include <atomic>
 #include <stdint.h>
 #include <assert.h>
 #include "ClearKeyUtils.h"
 
-#if defined(_MSC_VER)
-#include <atomic>
-typedef std::atomic<uint32_t> AtomicRefCount;
-#else
-class AtomicRefCount {
-public:
-  explicit AtomicRefCount(uint32_t aValue)
-    : mCount(aValue)
-    , mMutex(GMPCreateMutex())
-  {
-    assert(mMutex);
-  }
-  ~AtomicRefCount()
-  {
-    if (mMutex) {
-      mMutex->Destroy();
-    }
-  }
-  uint32_t operator--() {
-    AutoLock lock(mMutex);
-    return --mCount;
-  }
-  uint32_t operator++() {
-    AutoLock lock(mMutex);
-    return ++mCount;
-  }
-  operator uint32_t() {
-    AutoLock lock(mMutex);
-    return mCount;
-  }
-private:
-  uint32_t mCount;
-  GMPMutex* mMutex;
-};
-#endif
-
 // Note: Thread safe.
 class RefCounted {
 public:
   void AddRef() {
-    ++mRefCount;
+    // A new reference can only be made from an existing one, so there's
+    // nothing to synchronize with here.
+    mRefCount.fetch_add(1, std::memory_order_relaxed);
   }
 
   uint32_t Release() {
-    uint32_t newCount = --mRefCount;
+    // Acquire/release so that all use of the object on other threads
+    // happens before we delete it.
+    uint32_t newCount = mRefCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
     if (!newCount) {
       delete this;
     }
@@ -81,33 +50,61 @@ protected:
   {
     assert(!mRefCount);
   }
-  AtomicRefCount mRefCount;
+  std::atomic<uint32_t> mRefCount;
 };
 
 template<class T>
 class RefPtr {
 public:
+  RefPtr() : mPtr(nullptr) {}
   explicit RefPtr(T* aPtr) : mPtr(nullptr) {
     Assign(aPtr);
   }
+  RefPtr(const RefPtr& aOther) : mPtr(nullptr) {
+    Assign(aOther.mPtr);
+  }
+  // Takes over aOther's reference, without an AddRef/Release pair.
+  RefPtr(RefPtr&& aOther) : mPtr(aOther.mPtr) {
+    aOther.mPtr = nullptr;
+  }
   ~RefPtr() {
     Assign(nullptr);
   }
   T* operator->() const { return mPtr; }
+  T* get() const { return mPtr; }
 
   RefPtr& operator=(T* aVal) {
     Assign(aVal);
     return *this;
   }
 
+  RefPtr& operator=(const RefPtr& aOther) {
+    Assign(aOther.mPtr);
+    return *this;
+  }
+
+  RefPtr& operator=(RefPtr&& aOther) {
+    if (this != &aOther) {
+      T* old = mPtr;
+      mPtr = aOther.mPtr;
+      aOther.mPtr = nullptr;
+      if (old) {
+        old->Release();
+      }
+    }
+    return *this;
+  }
+
 private:
   void Assign(T* aPtr) {
-    if (mPtr) {
-      mPtr->Release();
+    // AddRef before Release, in case aPtr is the object we already hold.
+    if (aPtr) {
+      aPtr->AddRef();
     }
+    T* old = mPtr;
     mPtr = aPtr;
-    if (mPtr) {
-      aPtr->AddRef();
+    if (old) {
+      old->Release();
     }
   }
   T* mPtr;
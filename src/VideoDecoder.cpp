@@ -32,6 +32,7 @@ VideoDecoder::VideoDecoder(GMPVideoHost *aHostAPI)
   , mWorkerThread(nullptr)
   , mMutex(nullptr)
   , mNumInputTasks(0)
+  , mInputTaskBytes(0)
   , mSentExtraData(false)
   , mIsFlushing(false)
   , mHasShutdown(false)
@@ -109,7 +110,16 @@ VideoDecoder::Decode(GMPVideoEncodedFrame* aInputFrame,
 
   {
     AutoLock lock(mMutex);
+    if (mNumInputTasks >= CLEARKEY_MAX_QUEUED_DECODES ||
+        mInputTaskBytes + aInputFrame->Size() > CLEARKEY_MAX_QUEUED_DECODE_BYTES) {
+      CK_LOGW("VideoDecoder::Decode queue full (%d frames, %u bytes); dropping frame",
+              mNumInputTasks, (uint32_t)mInputTaskBytes);
+      aInputFrame->Destroy();
+      mCallback->Error(GMPQuotaExceededErr);
+      return;
+    }
     mNumInputTasks++;
+    mInputTaskBytes += aInputFrame->Size();
   }
 
   // Note: we don't need the codec specific info on a per-frame basis.
@@ -147,6 +157,9 @@ VideoDecoder::DecodeTask(DecodeData* aData)
     AutoLock lock(mMutex);
     mNumInputTasks--;
     assert(mNumInputTasks >= 0);
+    size_t bytes = aData ? aData->mBuffer.size() : 0;
+    assert(mInputTaskBytes >= bytes);
+    mInputTaskBytes -= bytes;
   }
 
   if (mIsFlushing) {
@@ -223,6 +236,20 @@ VideoDecoder::DecodeTask(DecodeData* aData)
   }
 }
 
+int32_t
+VideoDecoder::NumQueuedInputs()
+{
+  AutoLock lock(mMutex);
+  return mNumInputTasks;
+}
+
+size_t
+VideoDecoder::QueuedInputBytes()
+{
+  AutoLock lock(mMutex);
+  return mInputTaskBytes;
+}
+
 void
 VideoDecoder::ReturnOutput(IMFSample* aSample,
                            int32_t aWidth,
@@ -26,6 +26,18 @@
 
 #include "mfobjects.h"
 
+// Limits on the frames queued for the decode thread. We withhold
+// InputDataExhausted while any are queued, which normally stops the host
+// sending more well before these are reached. Frames which would exceed
+// either limit anyway are dropped and reported to the host with
+// GMPQuotaExceededErr, so that memory stays bounded whatever the host does.
+#ifndef CLEARKEY_MAX_QUEUED_DECODES
+#define CLEARKEY_MAX_QUEUED_DECODES 128
+#endif
+#ifndef CLEARKEY_MAX_QUEUED_DECODE_BYTES
+#define CLEARKEY_MAX_QUEUED_DECODE_BYTES (64 * 1024 * 1024)
+#endif
+
 class VideoDecoder : public GMPVideoDecoder
                    , public RefCounted
 {
@@ -52,6 +64,10 @@ public:
 
   bool HasShutdown() { return mHasShutdown; }
 
+  // Frames queued for the decode thread.
+  int32_t NumQueuedInputs();
+  size_t QueuedInputBytes();
+
 private:
 
   virtual ~VideoDecoder();
@@ -100,6 +116,7 @@ private:
   std::vector<uint8_t> mAnnexB;
 
   int32_t mNumInputTasks;
+  size_t mInputTaskBytes;
   bool mSentExtraData;
 
   std::atomic<bool> mIsFlushing;
@@ -20,6 +20,8 @@
 
 #include "ClearKeyAsyncShutdown.h"
 #include "ClearKeySessionManager.h"
+#include "ClearKeySessionTransfer.h"
+#include "ClearKeyStorage.h"
 #include "gmp-api/gmp-async-shutdown.h"
 #include "gmp-api/gmp-decryption.h"
 #include "gmp-api/gmp-platform.h"
@@ -72,6 +74,8 @@ GMPGetAPI(const char* aApiName, void* aHostAPI, void** aPluginAPI)
 #endif
   else if (!strcmp(aApiName, GMP_API_ASYNC_SHUTDOWN)) {
     *aPluginAPI = new ClearKeyAsyncShutdown(static_cast<GMPAsyncShutdownHost*> (aHostAPI));
+  } else if (!strcmp(aApiName, CLEARKEY_API_SESSION_TRANSFER)) {
+    *aPluginAPI = new ClearKeySessionTransfer(static_cast<ClearKeySessionTransferHost*>(aHostAPI));
   } else {
     CK_LOGE("GMPGetAPI couldn't resolve API name |%s|\n", aApiName);
   }
@@ -83,6 +87,8 @@ GMP_EXPORT GMPErr
 GMPShutdown(void)
 {
   CK_LOGD("ClearKey GMPShutdown");
+  CK_LOGD("ClearKey record cache served %u reads, missed %u",
+          RecordCacheHits(), RecordCacheMisses());
   return GMPNoErr;
 }
 